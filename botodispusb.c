@@ -7,9 +7,50 @@
  *		-> deteccio de connexio de dispositiu 'botodispusb' : registrar el dispositiu i demanar recursos
  *									(endpoints, buffers, urbs, etc.)
  *		-> deteccio de desconnexio del dispositiu : alliberar recursos i desregistrar dispositiu
- *		-> controlar l'acces al dispositiu amb 'open' i 'release' : nomes pot entrar una aplicacio en tot moment
+ *		-> controlar l'acces al dispositiu amb 'open' i 'release' : el poden obrir diverses aplicacions alhora
+ *		   (p.ex., l'aplicacio principal i un monitor); obrint-lo per escriure amb O_EXCL, s'es l'unic escriptor
  *		-> enviament al dispositiu (display) dels bytes passats a traves la funcio d'escriptura
+ *		   (la posicio del fitxer es l'adreca de la cel·la: 'lseek', 'pwrite' i 'pwritev' escriuen on toca)
+ *		-> displays de diverses files ('num_files' x 'num_columnes', o l'atribut sysfs 'geometria'),
+ *		   amb salt de linia automatic i desplaçament del text cap amunt en arribar al final
+ *		-> opcionalment, les escriptures petites s'ajunten durant 'coalescencia_us' microsegons
+ *		   (o fins omplir un paquet) abans d'enviar-les; 'fsync' les envia de seguida
+ *		   (amb un anell d'urbs de sortida, per poder tenir diversos paquets en curs alhora)
+ *		-> copia del contingut del display a memoria, per enviar nomes els caracters que canvien
+ *		-> projeccio d'aquesta copia a l'espai de l'aplicacio amb 'mmap' (i enviament amb 'ioctl' o 'msync')
  *		-> recepcio dels bytes que genera el dispositiu (teclat) i reenviament cap al display
+ *		-> lectura de les tecles premudes amb 'read' (bloquejant o no) i espera amb 'poll'/'select';
+ *		   cada obertura te la seva posicio a l'anell de tecles i les rep totes
+ *		-> escriptura no bloquejant (O_NONBLOCK): -EAGAIN si l'anell de sortida es ple, i POLLOUT quan
+ *		   torna a haver-hi lloc
+ *		-> punts de traça (botodispusb_trace.h) en lloc de missatges als camins frequents, i histograma
+ *		   de la latencia tecla -> eco a debugfs (botodispusb/bd_usbN/latencia_eco)
+ *		-> estadistiques per CPU de cada dispositiu (urbs, errors, bytes, tecles, esperes de l'anell)
+ *		   al grup sysfs 'estadistiques' de la interficie, amb l'atribut 'reiniciar' per posar-les a zero
+ *		-> diversos urbs de captacio de tecles enviats alhora, amb interval de sondeig configurable
+ *		   (parametre i sysfs) i adaptatiu: curt mentre es premen tecles i llarg quan el teclat es inactiu
+ *		-> cua de treballs propia de cada dispositiu (l'eco de les tecles no depen de la carrega del sistema)
+ *		-> molts dispositius alhora ('/dev/bd_usb0', '/dev/bd_usb1' ...) i escriptura d'un mateix text a
+ *		   diversos displays amb una sola crida (BDU_IOC_DIFONDRE)
+ *		-> lots d'operacions de cursor, text, esborrat i comandes en una sola crida i amb el minim de
+ *		   paquets (BDU_IOC_OPERACIONS)
+ *		-> marquesina i parpelleig per fila generats amb un hrtimer, que nomes envia les cel·les que
+ *		   canvien a cada pas (BDU_IOC_ANIMAR)
+ *		-> glifs definits per l'aplicacio (BDU_IOC_GLIF), repartits entre les 8 posicions de la memoria de
+ *		   caracters (CGRAM) del display amb una politica LRU; nomes s'envia un glif quan no hi es carregat
+ *		-> el teclat tambe es registra com a dispositiu d'entrada (evdev): cada tecla genera MSC_SCAN amb el
+ *		   codi ASCII i la pulsacio i alliberament del KEY_* corresponent (taula canviable amb EVIOCSKEYCODE)
+ *		-> taula d'accions per tecla (eco, esborrar, netejar, moure el cursor, nomes lector, macro) que
+ *		   executa el driver sense passar per l'aplicacio (BDU_IOC_ACCIONS)
+ *		-> tots els buffers de transferencia en un sol bloc DMA coherent, demanat al connectar el
+ *		   dispositiu i reutilitzat per tots els enviaments (sense mapejar/desmapejar a cada paquet)
+ *		-> recuperacio dels errors d'enviament: desbloqueig de l'endpoint aturat (STALL) i reenviament
+ *		   de tot el display, amb esperes creixents entre intents; si no es pot, l'escriptor rep l'error
+ *		-> autosuspensio quan no hi ha paquets en curs: es deixa de sondejar el teclat i el dispositiu
+ *		   desperta l'ordinador en premer una tecla (despertar remot). La darrera latencia represa -> eco
+ *		   es pot consultar a l'atribut sysfs 'latencia_represa_us'
+ *		-> empaquetament de comandes i dades amb el codificador de botodispusb_codificador.h (sense
+ *		   reservar memoria, copiant els trams de cop), compartit amb les eines d'espai d'usuari (eines/)
  *		-> esborrat del caracter anterior del display amb la tecla 'F'
  *
  *		Aquest driver esta suportat per la versio del kernel 2.6.XX.
@@ -30,18 +71,63 @@
 #include <linux/usb.h>		/* totes les estructures i funcions relacionades amb l'USB */
 #include <linux/uaccess.h>	/* get_user, copy_to_user, ...*/
 #include <linux/semaphore.h>	/* init_MUTEX */
-#include <linux/workqueue.h>	/* INIT_WORK, schedule_work, flush_work ... */
-//#include <linux/wait.h>		/* wait_queu_head_t, wait_interruptible, wakeup */
+#include <linux/workqueue.h>	/* INIT_WORK, queue_work, create_singlethread_workqueue ... */
+#include <linux/wait.h>		/* wait_queu_head_t, wait_interruptible, wakeup */
+#include <linux/kfifo.h>	/* DECLARE_KFIFO, kfifo_put, kfifo_to_user ... */
+#include <linux/mutex.h>	/* mutex_init, mutex_lock_interruptible ... */
+#include <linux/poll.h>		/* poll_wait, POLLIN ... */
+#include <linux/mm.h>		/* vm_area_struct, PAGE_ALIGN ... */
+#include <linux/file.h>		/* fget, fput */
+#include <linux/vmalloc.h>	/* vmalloc_user, vfree, remap_vmalloc_range */
+#include <linux/hrtimer.h>	/* hrtimer_init, hrtimer_start, hrtimer_cancel ... */
+#include <linux/ktime.h>	/* ktime_get, ktime_sub, ktime_to_us ... */
+#include <linux/log2.h>		/* ilog2 */
+#include <linux/debugfs.h>	/* debugfs_create_dir, debugfs_create_file ... */
+#include <linux/seq_file.h>	/* seq_printf, single_open ... */
+#include <linux/percpu.h>	/* alloc_percpu, this_cpu_add, per_cpu_ptr ... */
+#include <linux/input.h>	/* input_allocate_device, input_report_key ... */
+#include <linux/usb/input.h>	/* usb_to_input_id */
+#include "botodispusb.h"	/* comandes ioctl compartides amb les aplicacions */
+#include "botodispusb_codificador.h"	/* empaquetament de comandes i dades (compartit amb eines/) */
+#define CREATE_TRACE_POINTS
+#include "botodispusb_trace.h"	/* punts de traça del driver */
 
 /**
  *	DEFINES
  */
 #define VENDOR_ID	0x04d8
 #define PRODUCT_ID	0x00bd
-#define NUM_FILES_DEF	20
-//#define NUM_COLUMNES	40
+#define NUM_FILES_DEF	1
+#define NUM_FILES_MAX	4	/* el display nomes sap adreçar 4 files */
+#define NUM_COLUMNES_MAX	40
+#define NUM_URBS_SORTIDA_DEF	8	/* urbs de sortida (bulk_out) que poden estar en curs alhora */
+#define NUM_URBS_SORTIDA_MAX	64
+#define NUM_URBS_ENTRADA_DEF	2	/* urbs de captacio de tecles (interrupt_in) enviats alhora */
+#define NUM_URBS_ENTRADA_MAX	8
+#define INTERVAL_TECLAT_DEF	250	/* interval de sondeig del teclat en repos (mil·lisegons) */
+#define INTERVAL_TECLAT_MAX	255	/* maxim que admet el descriptor d'un endpoint interrupt */
+#define INACTIVITAT_TECLAT_MS	2000	/* temps sense tecles per tornar a l'interval de repos */
+#define RECUPERACIO_MIN_MS	2	/* espera abans del primer intent de recuperacio (es dobla a cada intent) */
+#define RECUPERACIO_MAX_MS	500	/* espera maxima entre intents de recuperacio */
+#define INTENTS_RECUPERACIO	8	/* intents seguits abans de deixar-ho i avisar l'escriptor */
+#define TEMPS_DESPERTAR_MS	1000	/* una tecla que arriba mes tard despres de la represa no l'ha despertada */
+#define MINOR_BASE_DEF		0	/* primer minor que es prova (el nucli salta els que ja estan ocupats) */
+#define MIDA_CUA_TECLES		256	/* tecles que es poden memoritzar (ha de ser potencia de 2) */
+#define NUM_COLUMNES_DEF	16	/* columnes visibles del display */
+#define MAX_CELLES		80	/* mida de la memoria de caracters (DDRAM) del display */
+#define COALESCENCIA_MAX_US	1000000	/* espera maxima per ajuntar escriptures (1 segon) */
+#define SINC_CURSOR		0x01	/* opcions de 'bdu_sincronitzar': deixar el cursor a la posicio logica */
+#define SINC_NO_BLOQUEJAR	0x02	/*	no esperar entrades de l'anell (la resta s'envia en alliberar-se'n) */
+#define NUM_FRANGES_LATENCIA	24	/* franges (potencies de 2 de microsegons) de l'histograma de latencia */
+#define NUM_RANURES_CGRAM	8	/* glifs que pot tenir el display alhora (codis 0 .. 7) */
+#define BYTES_GLIF		8	/* files de punts de cada glif */
+#define GLIF_NO_DISPONIBLE	'?'	/* es mostra si un glif no esta definit o no hi ha ranura lliure */
+#define NUM_CODIS_TECLA		128	/* codis (ASCII) que pot enviar el teclat */
 #define kref_to_dev(r)	container_of(r, struct bdusb, bdu_refcount)
 #define work_to_dev(w)	container_of(w, struct bdusb, t_teclat)
+#define file_to_dev(f)	(((struct bdu_obertura *) (f)->private_data)->dev)
+#define ESCRIPTOR_EXCLUSIU	-1	/* valor de 'escriptors' quan hi ha un escriptor exclusiu */
+#define BDU_COMPTAR(dev, camp, n)	this_cpu_add((dev)->estadistiques->camp, (n))
 
 /** 
  *	Declaracio de funcions estructurals de qualsevol driver USB
@@ -49,22 +135,177 @@
 static int __init bdu_init(void);
 static void __exit bdu_exit(void);
 static int bdu_probe(struct usb_interface *interface, const struct usb_device_id *id);
+static int bdu_suspend(struct usb_interface *interface, pm_message_t message);
+static int bdu_resume(struct usb_interface *interface);
+static int bdu_reset_resume(struct usb_interface *interface);
 static void bdu_disconnect(struct usb_interface *interface);
 static void bdu_delete(struct kref *bdu_kref);
 static int bdu_open(struct inode *inode, struct file *file);
 static int bdu_release(struct inode *inode, struct file *file);
 static ssize_t bdu_write(struct file *file, const char *user_buffer, size_t count, loff_t *ppos);
+static ssize_t bdu_aio_write(struct kiocb *iocb, const struct iovec *iov, unsigned long nr_segs, loff_t pos);
+static loff_t bdu_llseek(struct file *file, loff_t offset, int whence);
 static void bdu_out_callback(struct urb *bdu_urb, struct pt_regs *regs);
 static ssize_t bdu_read(struct file *file, char *user_buffer, size_t count, loff_t *ppos);
 static void bdu_in_callback(struct urb *bdu_urb, struct pt_regs *regs);
+static unsigned int bdu_poll(struct file *file, poll_table *wait);
+static long bdu_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int bdu_mmap(struct file *file, struct vm_area_struct *vma);
+static int bdu_fsync(struct file *file, int datasync);
 
 /**
  *	Declaracio de funcions especifiques d'aquest driver
  */
+struct bdusb;
+struct bdu_sortida;
+struct bdu_lot;
+struct bdu_escriptura;
+struct bdu_obertura;
 void Processar_tecla(struct work_struct *work);
+static int bdu_crear_buffers(struct bdusb *dev);
+static int bdu_crear_sortides(struct bdusb *dev);
+static struct bdu_sortida *bdu_obtenir_sortida(struct bdusb *dev, int no_bloquejar);
+static int bdu_enviar_sortida(struct bdusb *dev, struct bdu_sortida *sortida, int longitud);
+static void bdu_alliberar_sortida(struct bdusb *dev, struct bdu_sortida *sortida);
+static void bdu_lot_iniciar(struct bdusb *dev, struct bdu_lot *lot, int no_bloquejar);
+static int bdu_lot_obtenir(void *context, unsigned char **paquet);
+static int bdu_lot_enviar(void *context, int longitud);
+static void bdu_marcar_brut(struct bdusb *dev, int inici, int fi);
+static int bdu_sincronitzar(struct bdusb *dev, int opcions);
+static int bdu_refrescar(struct bdusb *dev);
+static ssize_t bdu_escriure_celles(struct bdusb *dev, loff_t pos, const char *user_buffer, size_t count);
+static void bdu_desplacar_amunt(struct bdusb *dev);
+static int bdu_canviar_geometria(struct bdusb *dev, int files, int columnes);
+static int bdu_enviar_escriptura(struct bdusb *dev, int no_bloquejar);
+static int bdu_comencar_escriptura(struct bdusb *dev, int no_bloquejar);
+static int bdu_hi_ha_sortida_lliure(struct bdusb *dev);
+static int bdu_sortides_lliures(struct bdusb *dev);
+static enum hrtimer_restart bdu_fi_coalescencia(struct hrtimer *temporitzador);
+static void bdu_buidar(struct work_struct *work);
+static void bdu_apuntar_latencia(struct bdusb *dev, ktime_t inici);
+static int bdu_mostrar_latencia(struct seq_file *s, void *data);
+static int bdu_crear_entrades(struct bdusb *dev);
+static int bdu_enviar_entrada(struct bdusb *dev, struct urb *urb, gfp_t memoria);
+static int bdu_enviar_entrades(struct bdusb *dev, gfp_t memoria);
+static void bdu_ajustar_interval(struct work_struct *work);
+static struct bdusb *bdu_obtenir_dispositiu(int minor);
+static void bdu_escriure_bloc(struct bdusb *dev, struct bdu_escriptura *e, const unsigned char *bloc, size_t n);
+static size_t bdu_escapades_finals(const unsigned char *bloc, size_t n);
+static int bdu_acaba_en_escapada(const char *user_buffer, size_t count);
+static long bdu_definir_glif(struct bdusb *dev, const struct bdu_glif *g);
+static unsigned char bdu_codi_glif(struct bdusb *dev, unsigned int id);
+static int bdu_crear_teclat_entrada(struct bdusb *dev);
+static void bdu_informar_tecla(struct bdusb *dev, unsigned char tecla);
+static void bdu_executar_accio(struct bdusb *dev, unsigned char tecla);
+static long bdu_carregar_accions(struct bdusb *dev, const struct bdu_accions *accions);
+static long bdu_difondre(struct file *file, const struct bdu_difusio *d);
+static long bdu_executar_operacions(struct file *file, const struct bdu_operacions *ops);
+static int bdu_afegir_canvis(struct bdusb *dev, struct bdu_lot *lot, int opcions);
+static int bdu_acabar_sincronitzacio(struct bdusb *dev, int retval);
+static long bdu_carregar_animacio(struct bdusb *dev, const struct bdu_animacio *a);
+static enum hrtimer_restart bdu_fi_animacio(struct hrtimer *temporitzador);
+static void bdu_animar(struct work_struct *work);
+static void bdu_pintar_animacio(struct bdusb *dev, int fila);
+static void bdu_aturar_animacions(struct bdusb *dev);
+static void bdu_programar_recuperacio(struct bdusb *dev);
+static void bdu_recuperar(struct work_struct *work);
+static int bdu_error_pendent(struct bdusb *dev);
+static int bdu_registrar_escriptor(struct bdusb *dev, int exclusiu);
+static int bdu_pot_escriure(struct bdusb *dev, struct file *file);
+static unsigned int bdu_copiar_tecles(struct bdusb *dev, struct bdu_obertura *obertura, unsigned char *tecles, unsigned int max);
 
 
-/** 
+/**
+ *	Comptadors d'un dispositiu (n'hi ha una copia per CPU; es sumen en llegir-los des de sysfs)
+ */
+struct bdu_estadistiques
+{
+	unsigned long	urbs_enviats;		// urbs de sortida enviats amb exit
+	unsigned long	urbs_no_enviats;	// urbs de sortida que 'usb_submit_urb' no ha acceptat
+	unsigned long	urbs_completats;	// urbs de sortida completats sense error
+	unsigned long	urbs_enoent;		// urbs de sortida completats amb -ENOENT
+	unsigned long	urbs_econnreset;	// urbs de sortida completats amb -ECONNRESET
+	unsigned long	urbs_eshutdown;		// urbs de sortida completats amb -ESHUTDOWN
+	unsigned long	urbs_epipe;		// urbs de sortida completats amb -EPIPE (endpoint aturat)
+	unsigned long	urbs_altres_errors;	// urbs de sortida completats amb qualsevol altre error
+	unsigned long	recuperacions;		// vegades que s'ha tornat a enviar el display despres d'un error
+	unsigned long	bytes_escrits;		// caracters acceptats per 'write'
+	unsigned long	bytes_enviats;		// bytes (capçaleres incloses) que han arribat al display
+	unsigned long	tecles_rebudes;		// tecles rebudes pel interrupt_in_endpoint
+	unsigned long	tecles_perdudes;	// tecles que un lector no ha llegit a temps (sobreescrites a l'anell)
+						// o que no han cabut a la cua de l'eco (no s'han mostrat)
+	unsigned long	esperes_anell;		// vegades que s'ha hagut d'esperar una entrada lliure de l'anell
+	unsigned long	espera_anell_us;	// temps total esperant entrades lliures (en microsegons)
+};
+
+
+
+/**
+ *	Cada una de les entrades de l'anell d'urbs de sortida cap al display
+ */
+struct bdu_sortida
+{
+	struct bdusb*	dev;		// dispositiu al qual pertany l'entrada
+	struct urb*	urb;		// urb preparat per enviar pel bulk_out_endpoint
+	unsigned char*	buffer;		// buffer de 'bulk_out_size' bytes associat a l'urb (dins de 'buffers')
+	int		seguent;	// index de la seguent entrada lliure (-1 si es l'ultima)
+	ktime_t		t_tecla;	// arribada de la tecla que fa eco aquest paquet (0 si no es un eco)
+};
+
+
+/**
+ *	Dades de cada obertura del dispositiu ('private_data' del fitxer)
+ */
+struct bdu_obertura
+{
+	struct bdusb*	dev;		// dispositiu obert
+	unsigned int	posicio;	// seguent tecla de l'anell ('cap_tecles') que ha de llegir aquesta obertura
+	struct mutex	mutex_lectura;	// serialitza les lectures fetes amb aquesta obertura
+	int		escriptor;	// 0 nomes lectura, 1 escriptor compartit, ESCRIPTOR_EXCLUSIU
+};
+
+
+/**
+ *	Estat d'una escriptura de text que es fa en diversos blocs (veure 'bdu_escriure_bloc')
+ */
+struct bdu_escriptura
+{
+	int	cella;		// cel·la on va el seguent caracter
+	int	fila_plena;	// l'ultim caracter ha omplert la fila (un '\n' ara no ha de saltar-ne una altra)
+	int	escapada;	// l'ultim byte era BDU_ESCAPADA_GLIF: el seguent es un id de glif
+};
+
+
+/**
+ *	Animacio (marquesina i/o parpelleig) d'una fila del display
+ */
+struct bdu_fila_animada
+{
+	unsigned char*	text;		// text que es desplaça (NULL si la fila no esta animada)
+	int		longitud;	// bytes de 'text'
+	int		posicio;	// index del caracter de 'text' que es veu a la primera columna
+	int		direccio;	// +1 cap a l'esquerra, -1 cap a la dreta
+	unsigned int	pas_ms;		// periode de desplaçament (0 sense desplaçament)
+	unsigned int	parpelleig_ms;	// mig periode de parpelleig (0 sense parpelleig)
+	int		visible;	// fase del parpelleig (0 fila en blanc)
+	ktime_t		seguent_pas;	// proper desplaçament
+	ktime_t		seguent_parpelleig;	// proper canvi de fase del parpelleig
+};
+
+
+/**
+ *	Paquet en construccio dins d'una entrada de l'anell de sortida (tipus 0x00 comandes, 0x01 dades)
+ */
+struct bdu_lot
+{
+	struct bdusb*		dev;
+	struct bdu_sortida*	sortida;	// entrada que s'esta omplint (NULL si no n'hi ha cap)
+	struct bdu_codificador	cod;		// empaquetament dins del buffer de 'sortida'
+	int			no_bloquejar;	// si no hi ha entrades lliures, retornar -EAGAIN en lloc d'esperar
+};
+
+
+/**
  *	Estructura de dades general per a controlar el driver
  */
 struct bdusb
@@ -73,6 +314,7 @@ struct bdusb
 	struct usb_device*	udev;
 	struct usb_interface*	interface;
 	struct kref		bdu_refcount;
+	int			minor;			// minor del dispositiu (per a les traces)
 
 	/* Les adreces dels endpoints */
 	u8	bulk_out_endpointAddr;
@@ -80,20 +322,101 @@ struct bdusb
 
 	/* Els buffers que es faran servir */	
 	size_t		bulk_out_size;
-	unsigned char*	bulk_out_buffer;
 	size_t		interrupt_in_size;
-	unsigned char*	interrupt_in_buffer;
-
-	/* Els urbs que es faran servir */
-	struct urb* 	urb_in_teclat;
-	struct urb*	urb_out_display;
+	unsigned char*	buffers;		// bloc DMA coherent amb els buffers de tots els urbs: primer els
+						// de sortida ('bulk_out_size') i despres els d'entrada ('interrupt_in_size')
+	dma_addr_t	buffers_dma;		// adreça DMA de 'buffers'
+	size_t		mida_buffers;
+
+	/* Els urbs de captacio de tecles (teclat) */
+	int			num_entrades;				// urbs de captacio enviats alhora
+	struct urb*		urbs_entrada[NUM_URBS_ENTRADA_MAX];	// urbs de captacio pel interrupt_in_endpoint
+	struct usb_anchor	anchor_entrada;				// urbs de captacio enviats
+	int			interval_repos;		// interval de sondeig (ms) quan no es premen tecles
+	int			interval_actiu;		// interval de sondeig (ms) mentre es premen tecles (0 no adaptatiu)
+	int			interval_programat;	// interval amb que s'envien ara els urbs de captacio
+	unsigned long		darrera_tecla;		// instant (jiffies) de l'ultima tecla rebuda
+	int			reprogramant;		// s'estan cancel·lant els urbs de captacio per canviar l'interval
+	struct delayed_work	t_interval;		// treball que adapta l'interval a l'activitat del teclat
+
+	/* L'anell d'urbs de sortida (display) */
+	int			num_sortides;		// numero d'entrades de l'anell
+	struct bdu_sortida*	sortides;		// vector amb totes les entrades
+	int			primera_lliure;		// index de la primera entrada lliure (-1 si no n'hi ha)
+	spinlock_t		lock_sortides;		// protegeix la llista d'entrades lliures
+	struct usb_anchor	anchor_sortida;		// urbs de sortida en curs
+	int			cancelant_sortides;	// el driver cancel·la els urbs de sortida (recuperacio, suspensio)
 
 	/* variables de control del dispositiu */
-	u8 num_access;			// numero d'accessos al dispositiu
-	u8 col_actual;			// columna actual del cursor del display
-	struct semaphore sem;		// semafor d'exclusio mutua
+	atomic_t escriptors;		// obertures que poden escriure (ESCRIPTOR_EXCLUSIU si n'hi ha una d'exclusiva)
+	int cursor;			// cel·la actual del cursor del display (posicio logica, fila * columnes + columna)
+	struct semaphore sem;		// semafor que compta les entrades lliures de l'anell de sortida
+	wait_queue_head_t cua_escriptura;	// escriptors esperant entrades lliures (poll)
 	struct work_struct t_teclat;	// treball per a controlar les pulsacions del teclat
-	char codi_tecla;		// memoritza el codi de la tecla que ha de processar el treball anterior
+	struct workqueue_struct* cua_treballs;	// fil propi on s'executen tots els treballs del dispositiu
+
+	/* tecles rebudes (un sol productor, 'bdu_in_callback') */
+	DECLARE_KFIFO(tecles_eco, unsigned char, MIDA_CUA_TECLES);	// tecles pendents de mostrar pel treball anterior
+	unsigned char anell_tecles[MIDA_CUA_TECLES];	// ultimes tecles rebudes, compartides per tots els lectors
+	unsigned int cap_tecles;	// tecles rebudes des de la connexio (la seguent va a 'cap_tecles % MIDA_CUA_TECLES');
+					// nomes l'augmenta 'bdu_in_callback', un cop la tecla ja es a l'anell (sense bloqueig)
+	wait_queue_head_t cua_lectura;	// lectors esperant tecles
+	ktime_t t_tecla;		// arribada de la tecla mes antiga encara sense eco (0 si no n'hi ha)
+	ktime_t t_eco;			// arribada de la tecla de l'eco que s'esta enviant (0 si no n'hi ha)
+
+	/* copia a memoria del contingut del display */
+	struct mutex mutex_pantalla;		// protegeix les variables seguents i 'cursor'
+	int files, columnes;			// geometria del display
+	int celles;				// numero de cel·les visibles ('files' * 'columnes')
+	unsigned char pantalla[MAX_CELLES];	// el que mostra el display (el que ja s'ha enviat)
+	unsigned char* desitjat;		// el que ha de mostrar el display (pagina projectable amb 'mmap')
+	int pantalla_valida;			// 0 si no se sap que mostra el display (s'esborrara abans d'enviar res)
+	int col_display;			// posicio real del cursor del display (-1 si es desconeguda)
+	int brut_inici, brut_fi;		// rang de cel·les de 'desitjat' pendents de comparar i enviar
+
+	/* coalescencia d'escriptures petites */
+	unsigned int coalescencia_us;		// temps maxim d'espera abans d'enviar una escriptura (0 desactivat)
+	struct hrtimer t_coalescencia;		// venciment de l'espera
+	struct work_struct t_buidar;		// treball que envia les escriptures pendents en vencer l'espera
+	int enviament_pendent;			// una sincronitzacio no bloquejant ha quedat a mitges
+
+	/* recuperacio dels errors d'enviament */
+	struct delayed_work t_recuperar;	// treball que desbloqueja l'endpoint i torna a enviar el display
+	int endpoint_aturat;			// el display ha respost amb STALL: cal 'usb_clear_halt' abans d'enviar
+	int intents_recuperacio;		// intents seguits sense cap enviament completat
+	int error_sortida;			// error que no s'ha pogut recuperar, pendent de retornar a l'escriptor
+
+	/* gestio d'energia */
+	int suspes;				// el dispositiu dorm (no es sondeja el teclat)
+	int redibuixar;				// s'han perdut paquets en suspendre: cal tornar a enviar el display
+	ktime_t t_represa;			// inici de l'ultima represa, fins a l'eco de la primera tecla (0 si no se n'espera cap)
+	unsigned int latencia_represa_us;	// temps entre l'ultima represa i l'eco de la tecla que l'ha provocada
+
+	/* glifs de l'aplicacio i la seva ubicacio a la CGRAM del display (protegits per 'mutex_pantalla') */
+	unsigned char glifs[BDU_GLIFS_MAX][BYTES_GLIF];	// mapa de punts de cada glif
+	DECLARE_BITMAP(glifs_definits, BDU_GLIFS_MAX);	// glifs que ha definit l'aplicacio
+	int ranura_glif[NUM_RANURES_CGRAM];		// glif carregat a cada ranura (-1 si es lliure)
+	unsigned long us_ranura[NUM_RANURES_CGRAM];	// instant de l'ultim us de cada ranura (per a LRU)
+	unsigned long rellotge_glifs;			// comptador que marca els instants d'us
+	unsigned int ranures_pendents;			// ranures que s'han d'enviar al display (un bit per ranura)
+
+	/* dispositiu d'entrada del teclat (evdev) */
+	struct input_dev* teclat;			// NULL si no s'ha pogut registrar
+	char cami_teclat[64];				// cami fisic del dispositiu d'entrada
+	unsigned short codis_tecla[NUM_CODIS_TECLA];	// KEY_* de cada codi ASCII (KEY_RESERVED si cap)
+
+	/* accio de cada tecla al display (protegida per 'mutex_pantalla') */
+	struct bdu_accio_tecla accions[BDU_NUM_TECLES];
+
+	/* animacions de les files (protegides per 'mutex_pantalla') */
+	struct bdu_fila_animada animacions[NUM_FILES_MAX];
+	struct hrtimer t_animacio;		// venciment del proper pas de qualsevol animacio
+	struct work_struct t_animar;		// treball que fa els passos vençuts i reprograma 't_animacio'
+
+	/* mesures (debugfs) */
+	struct dentry* dir_debugfs;		// directori del dispositiu a debugfs
+	unsigned long latencia_eco[NUM_FRANGES_LATENCIA];	// tecles per franja de latencia tecla -> eco
+	struct bdu_estadistiques __percpu *estadistiques;	// comptadors del dispositiu (un joc per CPU)
 };
 
 
@@ -103,15 +426,22 @@ struct bdusb
 static struct file_operations bdu_fops =
 {
 	.owner		=	THIS_MODULE,
+	.llseek		=	bdu_llseek,
 	.read		=	bdu_read,
 	.write		=	bdu_write,
+	.aio_write	=	bdu_aio_write,
+	.poll		=	bdu_poll,
+	.unlocked_ioctl	=	bdu_ioctl,
+	.compat_ioctl	=	bdu_ioctl,
+	.mmap		=	bdu_mmap,
+	.fsync		=	bdu_fsync,
 	.open		=	bdu_open,
 	.release	=	bdu_release
 };
 
 static struct usb_class_driver bdu_class =
 {
-	.name		=	"bd_usb",
+	.name		=	"bd_usb%d",	// el nucli hi posa l'index del dispositiu (minor - minor_base)
 	.fops		=	&bdu_fops,
 	.minor_base	=	0
 };
@@ -127,7 +457,11 @@ static struct usb_driver bdu_driver =
 	.name		=	"botodispusb",
 	.id_table 	=	taula_disp,
 	.probe 		=	bdu_probe,
-	.disconnect 	=	bdu_disconnect
+	.disconnect 	=	bdu_disconnect,
+	.suspend	=	bdu_suspend,
+	.resume		=	bdu_resume,
+	.reset_resume	=	bdu_reset_resume,
+	.supports_autosuspend =	1
 };
 
 
@@ -136,6 +470,22 @@ static struct usb_driver bdu_driver =
  */
 MODULE_DEVICE_TABLE(usb, taula_disp);
 int num_files= NUM_FILES_DEF;
+int num_columnes= NUM_COLUMNES_DEF;
+int coalescencia_us= 0;
+static struct dentry *bdu_dir_debugfs;		// directori del driver a debugfs
+int num_urbs_sortida= NUM_URBS_SORTIDA_DEF;
+int num_urbs_entrada= NUM_URBS_ENTRADA_DEF;
+int interval_teclat= INTERVAL_TECLAT_DEF;
+int interval_teclat_actiu= 0;
+int minor_base= MINOR_BASE_DEF;
+static DEFINE_MUTEX(bdu_mutex_dispositius);	// evita que un dispositiu es desconnecti mentre s'obte el seu 'dev'
+static const unsigned short bdu_codis_tecla_def[NUM_CODIS_TECLA] =	// codis KEY_* inicials de cada tecla
+{
+	['0'] = KEY_0, ['1'] = KEY_1, ['2'] = KEY_2, ['3'] = KEY_3, ['4'] = KEY_4,
+	['5'] = KEY_5, ['6'] = KEY_6, ['7'] = KEY_7, ['8'] = KEY_8, ['9'] = KEY_9,
+	['A'] = KEY_A, ['B'] = KEY_B, ['C'] = KEY_C, ['D'] = KEY_D, ['E'] = KEY_E, ['F'] = KEY_F,
+	['*'] = KEY_NUMERIC_STAR, ['#'] = KEY_NUMERIC_POUND
+};
 
 
 
@@ -148,8 +498,18 @@ static int __init bdu_init(void)
 
 	printk(KERN_INFO "BDUSB: __bdu_init__\n");
 
+	/* directori per a les mesures de cada dispositiu (si no hi ha debugfs, no passa res) */
+	bdu_dir_debugfs = debugfs_create_dir("botodispusb", NULL);
+
+	/* els dispositius ocuparan els minors lliures a partir de 'minor_base' */
+	bdu_class.minor_base = clamp(minor_base, 0, 255);
+
 	retval = usb_register(&bdu_driver);
-	if (retval) printk(KERN_ALERT " -> ERROR: usb_register ha fallat: numero d'error (%d)\n", retval);
+	if (retval)
+	{
+		printk(KERN_ALERT " -> ERROR: usb_register ha fallat: numero d'error (%d)\n", retval);
+		debugfs_remove_recursive(bdu_dir_debugfs);
+	}
 	return retval;
 }
 
@@ -162,8 +522,259 @@ static void __exit bdu_exit(void)
 	printk(KERN_INFO "BDUSB: __bdu_exit__\n");
 
 	usb_deregister(&bdu_driver);
+	debugfs_remove_recursive(bdu_dir_debugfs);
+}
+
+
+
+/**
+ *	bdu_mostrar_latencia: contingut del fitxer debugfs 'latencia_eco'
+ */
+static int bdu_mostrar_latencia(struct seq_file *s, void *data)
+{
+	struct bdusb *dev = s->private;
+	int i;
+
+	seq_printf(s, "%10s %10s : %s\n", "des de us", "fins a us", "tecles");
+	for (i = 0; i < NUM_FRANGES_LATENCIA; i++)
+		seq_printf(s, "%10lu %10lu : %lu\n", i ? 1UL << (i - 1) : 0UL, 1UL << i, dev->latencia_eco[i]);
+	return 0;
+}
+
+static int bdu_obrir_latencia(struct inode *inode, struct file *file)
+{
+	return single_open(file, bdu_mostrar_latencia, inode->i_private);
+}
+
+static const struct file_operations bdu_fops_latencia =
+{
+	.owner		=	THIS_MODULE,
+	.open		=	bdu_obrir_latencia,
+	.read		=	seq_read,
+	.llseek		=	seq_lseek,
+	.release	=	single_release
+};
+
+
+
+/**
+ *	Atribut sysfs 'geometria' de la interficie: files x columnes del display (p.ex., "2x40")
+ */
+static ssize_t bdu_mostrar_geometria(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%dx%d\n", dev->files, dev->columnes);
+}
+
+static ssize_t bdu_guardar_geometria(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+	int files, columnes, retval;
+
+	if (sscanf(buf, "%dx%d", &files, &columnes) != 2)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&dev->mutex_pantalla))
+		return -ERESTARTSYS;
+	retval = bdu_canviar_geometria(dev, files, columnes);
+	if (retval == 0)
+		retval = bdu_sincronitzar(dev, SINC_CURSOR);	// esborra el display
+	mutex_unlock(&dev->mutex_pantalla);
+	return retval ? retval : count;
+}
+
+static DEVICE_ATTR(geometria, S_IRUGO | S_IWUSR, bdu_mostrar_geometria, bdu_guardar_geometria);
+
+
+/**
+ *	Atribut sysfs 'coalescencia_us': espera maxima (en microsegons) per ajuntar escriptures petites (0 desactivat)
+ */
+static ssize_t bdu_mostrar_coalescencia(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%u\n", dev->coalescencia_us);
+}
+
+static ssize_t bdu_guardar_coalescencia(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned long us;
+
+	if (strict_strtoul(buf, 10, &us) || (us > COALESCENCIA_MAX_US))
+		return -EINVAL;
+	dev->coalescencia_us = us;
+	return count;
+}
+
+static DEVICE_ATTR(coalescencia_us, S_IRUGO | S_IWUSR, bdu_mostrar_coalescencia, bdu_guardar_coalescencia);
+
+
+/**
+ *	Atributs sysfs 'interval_teclat' i 'interval_teclat_actiu': interval de sondeig del teclat (en mil·lisegons)
+ *		en repos i mentre es premen tecles (0 vol dir que l'interval no s'adapta a l'activitat)
+ */
+static ssize_t bdu_mostrar_interval(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n", dev->interval_repos);
+}
+
+static ssize_t bdu_guardar_interval(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned long ms;
+
+	if (strict_strtoul(buf, 10, &ms) || (ms < 1) || (ms > INTERVAL_TECLAT_MAX))
+		return -EINVAL;
+	dev->interval_repos = ms;
+	queue_delayed_work(dev->cua_treballs, &dev->t_interval, 0);	// torna a enviar els urbs amb el nou interval
+	return count;
+}
+
+static DEVICE_ATTR(interval_teclat, S_IRUGO | S_IWUSR, bdu_mostrar_interval, bdu_guardar_interval);
+
+static ssize_t bdu_mostrar_interval_actiu(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n", dev->interval_actiu);
+}
+
+static ssize_t bdu_guardar_interval_actiu(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned long ms;
+
+	if (strict_strtoul(buf, 10, &ms) || (ms > INTERVAL_TECLAT_MAX))
+		return -EINVAL;
+	dev->interval_actiu = ms;
+	queue_delayed_work(dev->cua_treballs, &dev->t_interval, 0);
+	return count;
+}
+
+static DEVICE_ATTR(interval_teclat_actiu, S_IRUGO | S_IWUSR, bdu_mostrar_interval_actiu, bdu_guardar_interval_actiu);
+
+
+/**
+ *	bdu_sumar_estadistica: suma les copies de totes les CPU del comptador que es troba a 'desplacament'
+ */
+static unsigned long bdu_sumar_estadistica(struct bdusb *dev, size_t desplacament)
+{
+	unsigned long total = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		total += *(unsigned long *) ((char *) per_cpu_ptr(dev->estadistiques, cpu) + desplacament);
+	return total;
+}
+
+/**
+ *	Atributs sysfs del grup 'estadistiques': un fitxer de nomes lectura per comptador
+ */
+#define BDU_ATRIBUT_ESTADISTICA(camp)								\
+static ssize_t bdu_mostrar_##camp(struct device *d, struct device_attribute *attr, char *buf)	\
+{												\
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));				\
+												\
+	return sprintf(buf, "%lu\n",								\
+		bdu_sumar_estadistica(dev, offsetof(struct bdu_estadistiques, camp)));		\
+}												\
+static DEVICE_ATTR(camp, S_IRUGO, bdu_mostrar_##camp, NULL)
+
+BDU_ATRIBUT_ESTADISTICA(urbs_enviats);
+BDU_ATRIBUT_ESTADISTICA(urbs_no_enviats);
+BDU_ATRIBUT_ESTADISTICA(urbs_completats);
+BDU_ATRIBUT_ESTADISTICA(urbs_enoent);
+BDU_ATRIBUT_ESTADISTICA(urbs_econnreset);
+BDU_ATRIBUT_ESTADISTICA(urbs_eshutdown);
+BDU_ATRIBUT_ESTADISTICA(urbs_epipe);
+BDU_ATRIBUT_ESTADISTICA(urbs_altres_errors);
+BDU_ATRIBUT_ESTADISTICA(recuperacions);
+BDU_ATRIBUT_ESTADISTICA(bytes_escrits);
+BDU_ATRIBUT_ESTADISTICA(bytes_enviats);
+BDU_ATRIBUT_ESTADISTICA(tecles_rebudes);
+BDU_ATRIBUT_ESTADISTICA(tecles_perdudes);
+BDU_ATRIBUT_ESTADISTICA(esperes_anell);
+BDU_ATRIBUT_ESTADISTICA(espera_anell_us);
+
+/**
+ *	Atribut sysfs 'reiniciar': qualsevol escriptura posa tots els comptadors a zero
+ */
+static ssize_t bdu_guardar_reiniciar(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dev->estadistiques, cpu), 0, sizeof(struct bdu_estadistiques));
+	return count;
+}
+
+static DEVICE_ATTR(reiniciar, S_IWUSR, NULL, bdu_guardar_reiniciar);
+
+static struct attribute *bdu_atributs_estadistiques[] =
+{
+	&dev_attr_urbs_enviats.attr,
+	&dev_attr_urbs_no_enviats.attr,
+	&dev_attr_urbs_completats.attr,
+	&dev_attr_urbs_enoent.attr,
+	&dev_attr_urbs_econnreset.attr,
+	&dev_attr_urbs_eshutdown.attr,
+	&dev_attr_urbs_epipe.attr,
+	&dev_attr_urbs_altres_errors.attr,
+	&dev_attr_recuperacions.attr,
+	&dev_attr_bytes_escrits.attr,
+	&dev_attr_bytes_enviats.attr,
+	&dev_attr_tecles_rebudes.attr,
+	&dev_attr_tecles_perdudes.attr,
+	&dev_attr_esperes_anell.attr,
+	&dev_attr_espera_anell_us.attr,
+	&dev_attr_reiniciar.attr,
+	NULL
+};
+
+static struct attribute_group bdu_grup_estadistiques =
+{
+	.name	=	"estadistiques",
+	.attrs	=	bdu_atributs_estadistiques
+};
+
+
+
+/**
+ *	Atribut sysfs 'latencia_represa_us': temps entre l'ultima represa del dispositiu i l'eco de la tecla
+ *		que l'ha despertat (per ajustar 'power/autosuspend'); 0 si encara no n'hi ha hagut cap
+ */
+static ssize_t bdu_mostrar_latencia_represa(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdusb *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%u\n", dev->latencia_represa_us);
 }
 
+static DEVICE_ATTR(latencia_represa_us, S_IRUGO, bdu_mostrar_latencia_represa, NULL);
+
+
+
+/**
+ *	Atributs sysfs que es creen a la interficie de cada dispositiu
+ */
+static struct attribute *bdu_atributs[] =
+{
+	&dev_attr_geometria.attr,
+	&dev_attr_coalescencia_us.attr,
+	&dev_attr_interval_teclat.attr,
+	&dev_attr_interval_teclat_actiu.attr,
+	&dev_attr_latencia_represa_us.attr,
+	NULL
+};
+
+static struct attribute_group bdu_grup_atributs =
+{
+	.attrs	=	bdu_atributs
+};
 
 
 
@@ -180,7 +791,7 @@ static int bdu_probe(struct usb_interface *interface, const struct usb_device_id
 	printk(KERN_INFO "BDUSB: __bdu_probe__\n");
 
 	/* demanem un espai de memoria per a l'estructura general de control del dispositiu i l'inicialitzem */
-	dev = kmalloc(sizeof(struct bdusb), GFP_KERNEL);
+	dev = kzalloc(sizeof(struct bdusb), GFP_KERNEL);
 	if (dev == NULL)
 	{
 		err(" -> ERROR: no hi ha memoria per a l'estructura 'dev'\n");
@@ -212,22 +823,6 @@ static int bdu_probe(struct usb_interface *interface, const struct usb_device_id
 			dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
 			dev->bulk_out_size = endpoint->wMaxPacketSize;
 			printk(KERN_INFO "BDUSB: endpoint bulk_out amb mida de buffer (%d)\n", dev->bulk_out_size);
-			/* crear buffer per enviar dades al display */
-			dev->bulk_out_buffer = kmalloc(dev->bulk_out_size, GFP_KERNEL);
-			if (!dev->bulk_out_buffer)
-			{
-				err(" -> ERROR: no s'ha pogut crear bulk_out_buffer\n");
-				kref_put(&dev->bdu_refcount, bdu_delete);
-				return -ENOMEM;
-			}
-			/* crear urb per enviar dades al bulk_out_endpoint */
-			dev->urb_out_display = usb_alloc_urb(0, GFP_KERNEL);
-			if(!dev->urb_out_display)
-			{
-				err(" -> ERROR: no s'ha pogut crear el urb_out_display\n");
-				kref_put(&dev->bdu_refcount, bdu_delete);
-				return -ENOMEM;			
-			}
 		}
 		if (!dev->interrupt_in_endpointAddr && (endpoint->bEndpointAddress & USB_DIR_IN) &&
 		    ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT))
@@ -236,71 +831,156 @@ static int bdu_probe(struct usb_interface *interface, const struct usb_device_id
 			dev->interrupt_in_endpointAddr = endpoint->bEndpointAddress;
 			dev->interrupt_in_size = endpoint->wMaxPacketSize;
 			printk(KERN_INFO "BDUSB: endpoint interrupt_in amb mida de buffer (%d)\n", dev->interrupt_in_size);
-			/* crear buffer per rebre dades del teclat */
-			dev->interrupt_in_buffer = kmalloc(dev->interrupt_in_size, GFP_KERNEL);
-			if (!dev->interrupt_in_buffer)
-			{
-				err(" -> ERROR: no s'ha pogut crear interrupt_in_buffer\n");
-				kref_put(&dev->bdu_refcount, bdu_delete);
-				return -ENOMEM;
-			}
-			/* crear urb per rebre dades pel interrupt_in_endpoint */
-			dev->urb_in_teclat = usb_alloc_urb(0,GFP_KERNEL);
-			if(!dev->urb_in_teclat)
-			{
-				err(" -> ERROR: no s'ha pogut crear el urb_in_teclat\n");
-				kref_put(&dev->bdu_refcount, bdu_delete);
-				return -ENOMEM;			
-			}
 		}
 	}
 	if (!(dev->interrupt_in_endpointAddr && dev->bulk_out_endpointAddr))
 	{
 		err("\n ERROR: no s'han aconseguit els dos endpoints necessaris (bulk_out i interrupt_in)\n");
-		kref_put(&dev->bdu_refcount, bdu_delete);
-		return -ENOMEM;
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	/* crear el bloc DMA coherent amb els buffers de tots els urbs */
+	retval = bdu_crear_buffers(dev);
+	if (retval)
+	{
+		err(" -> ERROR: no s'han pogut crear els buffers de transferencia\n");
+		goto error;
+	}
+
+	/* crear l'anell d'urbs per enviar dades al display */
+	retval = bdu_crear_sortides(dev);
+	if (retval)
+	{
+		err(" -> ERROR: no s'ha pogut crear l'anell d'urbs de sortida\n");
+		goto error;
+	}
+
+	/* crear els urbs per rebre les tecles pel interrupt_in_endpoint */
+	retval = bdu_crear_entrades(dev);
+	if (retval)
+	{
+		err(" -> ERROR: no s'han pogut crear els urbs de captacio de tecles\n");
+		goto error;
+	}
+
+	/* crear la pagina amb el contingut desitjat del display (es pot projectar amb 'mmap') */
+	retval = -ENOMEM;
+	dev->desitjat = vmalloc_user(PAGE_ALIGN(MAX_CELLES));
+	if (!dev->desitjat)
+	{
+		err(" -> ERROR: no s'ha pogut crear la copia del display\n");
+		goto error;
+	}
+
+	/* crear els comptadors per CPU */
+	dev->estadistiques = alloc_percpu(struct bdu_estadistiques);
+	if (!dev->estadistiques)
+	{
+		err(" -> ERROR: no s'han pogut crear els comptadors\n");
+		goto error;
 	}
 	
+	/* crear el fil on s'executaran els treballs del dispositiu (eco de tecles, enviaments diferits ...) */
+	dev->cua_treballs = create_singlethread_workqueue("botodispusb");
+	if (!dev->cua_treballs)
+	{
+		err(" -> ERROR: no s'ha pogut crear la cua de treballs\n");
+		goto error;
+	}
+
+	/* inicialitza variables de control (tot abans de registrar el minor: des d'aleshores ja es pot obrir) */
+	atomic_set(&dev->escriptors, 0);
+	/* inicialitza la copia del display (s'esborrara el display amb el primer enviament) */
+	mutex_init(&dev->mutex_pantalla);
+	if (bdu_canviar_geometria(dev, num_files, num_columnes))
+	{
+		printk(KERN_INFO "BDUSB: geometria %dx%d no valida, es fa servir %dx%d\n",
+			num_files, num_columnes, NUM_FILES_DEF, NUM_COLUMNES_DEF);
+		bdu_canviar_geometria(dev, NUM_FILES_DEF, NUM_COLUMNES_DEF);
+	}
+	/* inicialitza el treball per manegar la visualitzacio de les tecles premudes */
+	INIT_WORK(&dev->t_teclat, Processar_tecla);
+	dev->accions['F'].accio = BDU_ACCIO_ESBORRAR;	// la resta fan eco (BDU_ACCIO_ECO es 0)
+	/* inicialitza les cues de tecles i l'espera dels lectors */
+	INIT_KFIFO(dev->tecles_eco);
+	init_waitqueue_head(&dev->cua_lectura);
+
+	/* inicialitza la coalescencia d'escriptures */
+	dev->coalescencia_us = min_t(unsigned int, max(coalescencia_us, 0), COALESCENCIA_MAX_US);
+	hrtimer_init(&dev->t_coalescencia, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->t_coalescencia.function = bdu_fi_coalescencia;
+	INIT_WORK(&dev->t_buidar, bdu_buidar);
+	INIT_DELAYED_WORK(&dev->t_recuperar, bdu_recuperar);
+
+	/* encara no hi ha cap glif carregat al display */
+	for (i = 0; i < NUM_RANURES_CGRAM; i++)
+		dev->ranura_glif[i] = -1;
+
+	/* inicialitza les animacions de les files */
+	hrtimer_init(&dev->t_animacio, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dev->t_animacio.function = bdu_fi_animacio;
+	INIT_WORK(&dev->t_animar, bdu_animar);
+
+	/* inicialitza l'interval de sondeig del teclat */
+	dev->interval_repos = clamp(interval_teclat, 1, INTERVAL_TECLAT_MAX);
+	dev->interval_actiu = clamp(interval_teclat_actiu, 0, INTERVAL_TECLAT_MAX);
+	dev->interval_programat = dev->interval_repos;
+	INIT_DELAYED_WORK(&dev->t_interval, bdu_ajustar_interval);
+
 	/* guardem un punter a l'estructura general 'dev' dins del camp de dades de la interficie de dispositiu */
 	usb_set_intfdata(interface, dev);
 
-	/* ara ja podem registrar el dispositiu, que estara associat a '/dev/btdispusb0' (si nomes controlarem un dispositiu) */
+	/* ara ja podem registrar el dispositiu, que estara associat a '/dev/bd_usbN' (N = minor - minor_base) */
 	retval = usb_register_dev(interface, &bdu_class);
 	if (retval)
 	{	/* something prevented us from registering this device */
 		err("\n ERROR: no s'ha aconseguit un minor per al dispositiu \n");
 		usb_set_intfdata(interface, NULL);
-		kref_put(&dev->bdu_refcount, bdu_delete);
-		return retval;
+		goto error;
 	}
 
 	/* let the user know what node this device is now attached to */	
-	printk(KERN_INFO "BDUSP: activat '/dev/btdispusb%d' amb Major (%d) Minor (%d)\n", interface->minor, USB_MAJOR, interface->minor);
+	printk(KERN_INFO "BDUSP: activat '/dev/bd_usb%d' amb Major (%d) Minor (%d)\n",
+		interface->minor - bdu_class.minor_base, USB_MAJOR, interface->minor);
+	dev->minor = interface->minor;
 
-	/* inicialitza variables de control */
-	dev->num_access = 0;
-	dev->col_actual = 0;
-	/* inicialitzem el semafor general per a l'enviament d'urbs de sortida (bulk_out) */
-	init_MUTEX(&dev->sem);
-	/* inicialitza el treball per manegar la visualitzacio de les tecles premudes */
-	INIT_WORK(&dev->t_teclat, Processar_tecla);
+	/* publica l'histograma de latencia tecla -> eco a debugfs */
+	if (bdu_dir_debugfs)
+	{
+		char nom[16];
 
-	/* inicialitza l'urb d'entrada per a captacio de la primera tecla (amb periode maxim de 250 mil·lisegons) */
-	usb_fill_int_urb(dev->urb_in_teclat, dev->udev,
-				usb_rcvintpipe(dev->udev, dev->interrupt_in_endpointAddr),
-				dev->interrupt_in_buffer,
-				dev->interrupt_in_size,
-				(void*) bdu_in_callback, dev, 250);
+		snprintf(nom, sizeof(nom), "bd_usb%d", dev->minor - bdu_class.minor_base);	// com el node de '/dev'
+		dev->dir_debugfs = debugfs_create_dir(nom, bdu_dir_debugfs);
+		debugfs_create_file("latencia_eco", S_IRUGO, dev->dir_debugfs, dev, &bdu_fops_latencia);
+	}
+
+	/* publica els atributs del display a sysfs */
+	if (sysfs_create_group(&interface->dev.kobj, &bdu_grup_atributs))
+		printk(KERN_INFO "BDUSB: no s'han pogut crear els atributs sysfs\n");
+	if (sysfs_create_group(&interface->dev.kobj, &bdu_grup_estadistiques))
+		printk(KERN_INFO "BDUSB: no s'han pogut crear les estadistiques sysfs\n");
 
-	/* enviament de l'urb per captar la primera tecla pulsada */
-	retval = usb_submit_urb(dev->urb_in_teclat, GFP_KERNEL);
+	/* registra el teclat com a dispositiu d'entrada (si falla, el driver funciona igual sense) */
+	if (bdu_crear_teclat_entrada(dev))
+		printk(KERN_INFO "BDUSB: no s'ha pogut registrar el dispositiu d'entrada del teclat\n");
+
+	/* el dispositiu pot dormir quan no hi ha paquets en curs: el desperta una tecla */
+	interface->needs_remote_wakeup = 1;
+	usb_enable_autosuspend(dev->udev);
+
+	/* enviament dels urbs per captar les primeres tecles pulsades */
+	retval = bdu_enviar_entrades(dev, GFP_KERNEL);
 	if (retval)
 	{
 		err("\n ERROR: no s'ha pogut enviar el primer URB de captacio de tecles\n");
-		kref_put(&dev->bdu_refcount, bdu_delete);
-		return retval;
+		bdu_disconnect(interface);	// el dispositiu ja esta registrat: es desfa tot com si s'hagues desconnectat
 	}
 	return retval;
+
+error:
+	kref_put(&dev->bdu_refcount, bdu_delete);
+	return retval;
 }
 
 
@@ -313,12 +993,40 @@ static void bdu_disconnect(struct usb_interface *interface)
 
 	printk(KERN_INFO "BDUSB: __bdu_disconnect__\n");
 	
-	/* espera que la cua de treballs estigui buida */
-	flush_scheduled_work();
-	
 	/* desregistra el dispositiu (i el minor) */
+	sysfs_remove_group(&interface->dev.kobj, &bdu_grup_atributs);
+	sysfs_remove_group(&interface->dev.kobj, &bdu_grup_estadistiques);
+	debugfs_remove_recursive(dev->dir_debugfs);
 	usb_deregister_dev(interface, &bdu_class);
 
+	/* a partir d'ara ja no es pot trobar 'dev' a partir del minor (ni obrir-lo) */
+	mutex_lock(&bdu_mutex_dispositius);
+	usb_set_intfdata(interface, NULL);
+	mutex_unlock(&bdu_mutex_dispositius);
+
+	/* marca el dispositiu com a desconnectat i desperta els lectors i escriptors que estiguin esperant */
+	dev->interface = NULL;
+	wake_up_interruptible(&dev->cua_lectura);
+	wake_up_interruptible(&dev->cua_escriptura);
+
+	/* atura la captacio de tecles (ja no es programaran mes ecos) */
+	cancel_delayed_work_sync(&dev->t_interval);
+	usb_kill_anchored_urbs(&dev->anchor_entrada);
+	if (dev->teclat) input_unregister_device(dev->teclat);
+
+	/* cancel·la els paquets cap al display que encara estiguin en curs abans d'esperar els treballs:
+	   un treball pot estar esperant una entrada de l'anell, que nomes s'allibera quan acaba un paquet.
+	   L'anchor queda enverinat: un enviament que hagi començat abans de 'interface = NULL' tambe falla */
+	usb_poison_anchored_urbs(&dev->anchor_sortida);
+
+	/* atura els treballs del dispositiu (nomes els seus, no tota la cua del sistema) */
+	hrtimer_cancel(&dev->t_coalescencia);
+	hrtimer_cancel(&dev->t_animacio);
+	cancel_work_sync(&dev->t_teclat);
+	cancel_work_sync(&dev->t_buidar);
+	cancel_work_sync(&dev->t_animar);
+	cancel_delayed_work_sync(&dev->t_recuperar);
+
 	/* allibera l'us de l'estructura 'dev' i els recursos demanats */
 	kref_put(&dev->bdu_refcount, bdu_delete);
 }
@@ -330,147 +1038,434 @@ static void bdu_disconnect(struct usb_interface *interface)
 static void bdu_delete(struct kref *bd_ref)
 {
 	struct bdusb *dev = kref_to_dev(bd_ref);
+	int i;
 
 	printk(KERN_INFO "BDUSB: __bdu_delete__\n");
 
-	/* allibera l'estructura d'informacio del dispositiu USB */
-	usb_put_dev(dev->udev);
+	/* primer s'acaben els treballs que encara siguin a la cua (els executa 'destroy_workqueue'):
+	   fan servir els urbs, l'anell de sortida i la copia del display que s'alliberen a continuacio.
+	   Abans s'aturen els temporitzadors (s'inicialitzen amb la cua): un escriptor que ja tenia
+	   'mutex_pantalla' quan s'ha desconnectat el dispositiu pot haver engegat el de coalescencia, i
+	   'bdu_animar' el de les animacions, despres dels 'hrtimer_cancel' de 'bdu_disconnect' */
+	if (dev->cua_treballs)
+	{
+		hrtimer_cancel(&dev->t_coalescencia);
+		hrtimer_cancel(&dev->t_animacio);
+		destroy_workqueue(dev->cua_treballs);
+	}
 
 	/* allibera els recursos obtinguts (urbs i buffers) */
-	if (dev->urb_in_teclat)		usb_free_urb(dev->urb_in_teclat);
-	if (dev->urb_out_display)	usb_free_urb(dev->urb_out_display);
-	if (dev->interrupt_in_buffer)	kfree(dev->interrupt_in_buffer);
-	if (dev->bulk_out_buffer)	kfree(dev->bulk_out_buffer);
+	for (i = 0; i < dev->num_entrades; i++)
+		if (dev->urbs_entrada[i])	usb_free_urb(dev->urbs_entrada[i]);
+	if (dev->sortides)
+	{
+		for (i = 0; i < dev->num_sortides; i++)
+			if (dev->sortides[i].urb)	usb_free_urb(dev->sortides[i].urb);
+		kfree(dev->sortides);
+	}
+	if (dev->buffers)	usb_free_coherent(dev->udev, dev->mida_buffers, dev->buffers, dev->buffers_dma);
+
+	/* allibera l'estructura d'informacio del dispositiu USB (un cop alliberats els buffers DMA) */
+	usb_put_dev(dev->udev);
+	if (dev->desitjat)	vfree(dev->desitjat);
+	for (i = 0; i < NUM_FILES_MAX; i++)
+		kfree(dev->animacions[i].text);
+	if (dev->estadistiques)	free_percpu(dev->estadistiques);
 	kfree(dev);
 }
 
 
 
 /**
- *	bdu_open: s'invoca quan una aplicació intenta accedir al driver (p.ex., amb crida a 'fopen')
+ *	bdu_suspend: s'invoca abans d'adormir el dispositiu (autosuspensio o suspensio del sistema)
+ *		Cada paquet en curs te una referencia de la interficie, de manera que l'autosuspensio nomes
+ *		arriba quan no n'hi ha cap. Mentre dorm, no es sondeja el teclat: el desperta una tecla.
  */
-static int bdu_open(struct inode *inode, struct file *file)
+static int bdu_suspend(struct usb_interface *interface, pm_message_t message)
 {
-	struct bdusb *dev;
-	struct usb_interface *interface;
-	int subminor = iminor(inode);
+	struct bdusb *dev = (struct bdusb *) usb_get_intfdata(interface);
 
-	printk(KERN_INFO "BDUSB: __bdu_open__\n");
+	if (!dev) return 0;
+	if ((message.event & PM_EVENT_AUTO) && !usb_anchor_empty(&dev->anchor_sortida)) return -EBUSY;
 
-	interface = usb_find_interface(&bdu_driver, subminor);
-	if (!interface)
-	{
-		err(" -> ERROR: no es pot detectar el dispositiu amb minor numero (%d)\n",subminor);
-		return -ENODEV;
-	}
-	dev = usb_get_intfdata(interface);
-	if (!dev)
-	{
-		err(" -> ERROR: no s'havia emmagatzemat res al camp de dades de la interficie de dispositiu\n");
-		return -ENODEV;
-	}
-	if (dev->num_access > 0)
+	dev->suspes = 1;
+	cancel_delayed_work_sync(&dev->t_interval);
+	usb_kill_anchored_urbs(&dev->anchor_entrada);
+
+	/* en la suspensio del sistema es perden els paquets que quedin: es redibuixara en despertar */
+	if (!usb_anchor_empty(&dev->anchor_sortida))
 	{
-		err(" -> ERROR: ja hi ha un acces al driver (%d)\n",subminor);
-		return -ENODEV;
+		dev->cancelant_sortides = 1;
+		usb_kill_anchored_urbs(&dev->anchor_sortida);
+		dev->cancelant_sortides = 0;
+		dev->redibuixar = 1;
 	}
-	/* apuntar que hi ha un acces a l'estructura 'dev' */
-	kref_get(&dev->bdu_refcount);
-	/* memoritza l'adreça de l'estructura de dades del dispositiu per a les funcions 'read', 'write' i 'release' */
-	file->private_data = dev;
-	/* memoritzar que ja tenim un acces al dispositiu */
-	dev->num_access = 1;
 	return 0;
 }
 
 
 /**
- *	bdu_release: s'invoca quan una aplicacio allibera el seu acces al driver (p.ex., amb crida a 'fclose')
+ *	bdu_resume: s'invoca quan el dispositiu es desperta (per una tecla, per un enviament o pel sistema)
+ *		No pot agafar 'mutex_pantalla' (la represa pot venir d'un enviament que el te agafat): el
+ *		redibuixat, si cal, el fa el treball de recuperacio.
  */
-static int bdu_release(struct inode *inode, struct file *file)
+static int bdu_resume(struct usb_interface *interface)
 {
-	struct bdusb *dev = (struct bdusb *) file->private_data;
-
-	if (dev == NULL) return -ENODEV;
+	struct bdusb *dev = (struct bdusb *) usb_get_intfdata(interface);
 
-	printk(KERN_INFO "BDUSB: __bdu_release__\n");
+	if (!dev) return 0;
+	dev->t_represa = ktime_get();
+	dev->suspes = 0;
 
-	/* allibera l'acces a l'estructura 'dev' */
-	kref_put(&dev->bdu_refcount, bdu_delete);
-	/* memoritza que el dispositiu ja esta lliure per a tornar a ser accedit */
-	dev->num_access = 0;
-	return 0;
+	/* si l'ha despertat una tecla, en vindran mes: es sondeja amb l'interval actiu des del primer moment */
+	if (dev->interval_actiu)
+	{
+		dev->darrera_tecla = jiffies;
+		dev->interval_programat = dev->interval_actiu;
+		queue_delayed_work(dev->cua_treballs, &dev->t_interval, msecs_to_jiffies(INACTIVITAT_TECLAT_MS));
+	}
+	if (dev->redibuixar)
+	{
+		dev->redibuixar = 0;
+		queue_delayed_work(dev->cua_treballs, &dev->t_recuperar, 0);
+	}
+	return bdu_enviar_entrades(dev, GFP_NOIO);
 }
 
 
-
 /**
- *	bdu_write: s'invoca quan una aplicacio envia informacio cap al driver (p.ex., amb crida a 'fwrite')
- *		Aquesta funcio envia cap al display fins a 16 bytes que se li passen pel buffer i retorna immediatament.
+ *	bdu_reset_resume: s'invoca quan el dispositiu s'ha hagut de reiniciar per despertar-lo
+ *		El display ha perdut el contingut i els glifs: es torna a enviar tot.
  */
-static ssize_t bdu_write(struct file *file, const char *user_buffer, size_t count, loff_t *ppos)
+static int bdu_reset_resume(struct usb_interface *interface)
 {
-	struct bdusb *dev = (struct bdusb *) file->private_data;	
-	int i;
-	char dada;
-	
-	printk(KERN_INFO "BDUSB: __bdu_write__\n");
-
-	dev->bulk_out_buffer[0] = 0x01;		// preparem un paquet de dades
-	i = 0;					// del punter d'escriptura a buffer
-	while ((i < count) && (dev->col_actual < 16))		// per a tots els bytes (fins omplir la primera linia)
-	{
-		get_user(dada, &user_buffer[i]);	// captura un caracter
-		dev->bulk_out_buffer[i+1] = dada;	// el memoritza al buffer d'enviament
-		dev->col_actual++;			// apuntem el desplaçament automatic del cursor
-		i++;
-	}
-	/* evitar utilitzar l'urb d'enviament si s'esta fent servir */	
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;		// retorna error si s'ha desbloquejat manualment amb Control-C
-
-	/* preparem l'urb per a enviament de dades */
-	usb_fill_bulk_urb(dev->urb_out_display, dev->udev,
-			usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-			dev->bulk_out_buffer, i+1, (void*) bdu_out_callback, dev);
-
-	/* enviament de l'urb */
-	if (usb_submit_urb(dev->urb_out_display, GFP_ATOMIC))
-		printk(KERN_INFO " -> ERROR: no s'ha pogut enviar el paquet d'escriptura de dades");
+	struct bdusb *dev = (struct bdusb *) usb_get_intfdata(interface);
 
-	return count;	// retornem el numero de caracters de l'aplicacio, per a simular que els ha processat tots
+	if (!dev) return 0;
+	dev->endpoint_aturat = 0;
+	dev->redibuixar = 1;
+	return bdu_resume(interface);
 }
 
 
 
 /**
- *	bdu_out_callback: s'invoca quan el dispositiu ha acceptar un paquet de bytes enviat des de l'ordinador
- *			(una interrupcio per cada paquet)
+ *	bdu_open: s'invoca quan una aplicació intenta accedir al driver (p.ex., amb crida a 'fopen')
  */
-static void bdu_out_callback(struct urb *bdu_urb, struct pt_regs *regs)
+static int bdu_open(struct inode *inode, struct file *file)
 {
-	struct bdusb *dev = (struct bdusb *) bdu_urb->context;
+	struct bdusb *dev;
+	struct bdu_obertura *obertura;
+	int subminor = iminor(inode);
+	int exclusiu = file->f_flags & O_EXCL;
+	int retval;
 
-	printk(KERN_INFO "BDUSB: __bdu_out_callback__ status (%d) \n", bdu_urb->status);
+	printk(KERN_INFO "BDUSB: __bdu_open__\n");
+
+	/* busca el dispositiu i apunta que hi ha un acces a l'estructura 'dev' */
+	dev = bdu_obtenir_dispositiu(subminor);
+	if (!dev)
+	{
+		err(" -> ERROR: no es pot detectar el dispositiu amb minor numero (%d)\n",subminor);
+		return -ENODEV;
+	}
+	obertura = kzalloc(sizeof(struct bdu_obertura), GFP_KERNEL);
+	if (!obertura)
+	{
+		kref_put(&dev->bdu_refcount, bdu_delete);
+		return -ENOMEM;
+	}
+	obertura->dev = dev;
+	mutex_init(&obertura->mutex_lectura);
+
+	/* per escriure cal que no hi hagi cap escriptor exclusiu (ni cap escriptor, si es vol ser-ho) */
+	if (file->f_mode & FMODE_WRITE)
+	{
+		retval = bdu_registrar_escriptor(dev, exclusiu);
+		if (retval)
+		{
+			kfree(obertura);
+			kref_put(&dev->bdu_refcount, bdu_delete);
+			return retval;
+		}
+		obertura->escriptor = exclusiu ? ESCRIPTOR_EXCLUSIU : 1;
+	}
+
+	/* desperta el dispositiu, que segurament rebra escriptures de seguida (despres ja pot tornar a dormir) */
+	retval = usb_autopm_get_interface(dev->interface);
+	if (retval)
+	{
+		file->private_data = obertura;
+		bdu_release(inode, file);
+		return retval;
+	}
+	usb_autopm_put_interface_async(dev->interface);
+
+	/* el lector rebra les tecles que es premin a partir d'ara */
+	obertura->posicio = ACCESS_ONCE(dev->cap_tecles);
+	/* memoritza les dades de l'obertura per a les funcions 'read', 'write', 'ioctl' ... i 'release' */
+	file->private_data = obertura;
+	/* les escriptures continuen a partir de la posicio actual del cursor */
+	file->f_pos = dev->cursor;
+	return 0;
+}
+
+
+/**
+ *	bdu_registrar_escriptor: apunta una obertura amb escriptura (sense bloquejar: tot amb operacions atomiques)
+ *		Un escriptor exclusiu nomes entra si no n'hi ha cap altre; un de compartit, si no n'hi ha cap d'exclusiu.
+ */
+static int bdu_registrar_escriptor(struct bdusb *dev, int exclusiu)
+{
+	int n;
+
+	if (exclusiu)
+		return (atomic_cmpxchg(&dev->escriptors, 0, ESCRIPTOR_EXCLUSIU) == 0) ? 0 : -EBUSY;
+	do
+	{
+		n = atomic_read(&dev->escriptors);
+		if (n == ESCRIPTOR_EXCLUSIU) return -EBUSY;
+	} while (atomic_cmpxchg(&dev->escriptors, n, n + 1) != n);
+	return 0;
+}
+
+
+/**
+ *	bdu_release: s'invoca quan una aplicacio allibera el seu acces al driver (p.ex., amb crida a 'fclose')
+ */
+static int bdu_release(struct inode *inode, struct file *file)
+{
+	struct bdu_obertura *obertura = (struct bdu_obertura *) file->private_data;
+	struct bdusb *dev;
+
+	if (obertura == NULL) return -ENODEV;
+	dev = obertura->dev;
+
+	printk(KERN_INFO "BDUSB: __bdu_release__\n");
+
+	/* deixa lloc a altres escriptors */
+	if (obertura->escriptor == ESCRIPTOR_EXCLUSIU)
+		atomic_set(&dev->escriptors, 0);
+	else if (obertura->escriptor)
+		atomic_dec(&dev->escriptors);
+	kfree(obertura);
+
+	/* allibera l'acces a l'estructura 'dev' (l'ultim, perque la pot alliberar) */
+	kref_put(&dev->bdu_refcount, bdu_delete);
+	return 0;
+}
+
+
+
+/**
+ *	bdu_write: s'invoca quan una aplicacio envia informacio cap al driver (p.ex., amb crida a 'fwrite' o 'pwrite')
+ *		Aquesta funcio escriu a la copia del display els bytes que se li passen pel buffer a partir de la
+ *		cel·la '*ppos' i envia nomes els caracters que han canviat. Retorna quan els paquets estan en curs.
+ *		Amb O_NONBLOCK retorna -EAGAIN si no hi ha cap entrada lliure a l'anell de sortida; si les entrades
+ *		s'acaben a mig enviament, la resta dels canvis s'envia tan aviat com se n'alliberi alguna.
+ */
+static ssize_t bdu_write(struct file *file, const char *user_buffer, size_t count, loff_t *ppos)
+{
+	struct bdusb *dev = file_to_dev(file);	
+	int no_bloquejar = file->f_flags & O_NONBLOCK;
+	loff_t pos = *ppos;
+	ssize_t n;
+	int retval;
+
+	retval = bdu_comencar_escriptura(dev, no_bloquejar);
+	if (retval)
+	{
+		trace_bdu_escriptura(dev->minor, pos, count, retval);
+		return retval;
+	}
+
+	n = bdu_escriure_celles(dev, *ppos, user_buffer, count);
+	if (n > 0)
+	{
+		/* enviament dels canvis (una comanda de cursor, si cal, i les dades), ara o en vencer l'espera */
+		retval = bdu_enviar_escriptura(dev, no_bloquejar);
+		if (retval)
+			n = retval;		// no s'ha pogut enviar: l'aplicacio ho ha de saber
+		else
+			*ppos = dev->cursor;	// el text pot haver saltat de linia o desplaçat el display
+	}
+	mutex_unlock(&dev->mutex_pantalla);
+
+	if (n > 0) BDU_COMPTAR(dev, bytes_escrits, n);
+	trace_bdu_escriptura(dev->minor, pos, count, n);
+	return n;	// retornem el numero de caracters acceptats
+}
+
+
+
+/**
+ *	bdu_aio_write: s'invoca amb les escriptures vectorials ('writev', 'pwritev')
+ *		Escriu tots els segments un rere l'altre a partir de la cel·la 'pos' i envia els canvis un sol cop.
+ */
+static ssize_t bdu_aio_write(struct kiocb *iocb, const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+	struct bdusb *dev = file_to_dev(iocb->ki_filp);
+	int no_bloquejar = iocb->ki_filp->f_flags & O_NONBLOCK;
+	ssize_t n, total = 0;
+	unsigned long i;
+	int retval;
+
+	retval = bdu_comencar_escriptura(dev, no_bloquejar);
+	if (retval) return retval;
+
+	for (i = 0; i < nr_segs; i++)
+	{
+		n = bdu_escriure_celles(dev, pos, iov[i].iov_base, iov[i].iov_len);
+		if (n < 0)
+		{
+			if (total == 0) total = n;
+			break;
+		}
+		total += n;
+		pos = dev->cursor;		// el seguent segment continua on ha acabat aquest
+	}
+	if (total > 0)
+	{
+		retval = bdu_enviar_escriptura(dev, no_bloquejar);
+		if (retval)
+			total = retval;
+		else
+			iocb->ki_pos = pos;
+	}
+	mutex_unlock(&dev->mutex_pantalla);
+
+	if (total > 0) BDU_COMPTAR(dev, bytes_escrits, total);
+	return total;
+}
+
+
+
+/**
+ *	bdu_comencar_escriptura: comprova que es pot escriure i agafa 'mutex_pantalla'
+ *		Amb 'no_bloquejar' no espera ni el mutex ni una entrada lliure de l'anell (retorna -EAGAIN).
+ */
+static int bdu_comencar_escriptura(struct bdusb *dev, int no_bloquejar)
+{
+	int retval;
+
+	if (!dev->interface) return -ENODEV;		// el dispositiu s'ha desconnectat
+
+	if (no_bloquejar)
+	{
+		if (!bdu_hi_ha_sortida_lliure(dev)) return -EAGAIN;
+		if (!mutex_trylock(&dev->mutex_pantalla)) return -EAGAIN;
+	}
+	else if (mutex_lock_interruptible(&dev->mutex_pantalla))
+		return -ERESTARTSYS;		// retorna error si s'ha desbloquejat manualment amb Control-C
+
+	retval = bdu_error_pendent(dev);
+	if (retval) mutex_unlock(&dev->mutex_pantalla);
+	return retval;
+}
+
+
+
+/**
+ *	bdu_error_pendent: retorna (un sol cop) l'error d'enviament que no s'ha pogut recuperar (amb 'mutex_pantalla' agafat)
+ */
+static int bdu_error_pendent(struct bdusb *dev)
+{
+	int error = dev->error_sortida;
+
+	if (!error) return 0;
+	dev->error_sortida = 0;
+	return (error == -EPIPE) ? -EPIPE : -EIO;
+}
+
+
+
+/**
+ *	bdu_llseek: s'invoca quan una aplicacio canvia la posicio del fitxer (p.ex., amb crida a 'lseek')
+ *		La posicio es l'adreca d'una cel·la del display (fila * columnes + columna); SEEK_END es relatiu
+ *		al final del display.
+ */
+static loff_t bdu_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct bdusb *dev = file_to_dev(file);
+	loff_t pos;
+
+	switch (whence)
+	{
+		case SEEK_SET:	pos = offset;				break;
+		case SEEK_CUR:	pos = file->f_pos + offset;		break;
+		case SEEK_END:	pos = dev->celles + offset;		break;
+		default:	return -EINVAL;
+	}
+	if ((pos < 0) || (pos > dev->celles))
+		return -EINVAL;
+	file->f_pos = pos;
+	return pos;
+}
+
+
+
+/**
+ *	bdu_out_callback: s'invoca quan el dispositiu ha acceptar un paquet de bytes enviat des de l'ordinador
+ *			(una interrupcio per cada paquet)
+ */
+static void bdu_out_callback(struct urb *bdu_urb, struct pt_regs *regs)
+{
+	struct bdu_sortida *sortida = (struct bdu_sortida *) bdu_urb->context;
+	struct bdusb *dev = sortida->dev;
+
+	trace_bdu_completat(dev->minor, sortida - dev->sortides, bdu_urb->status, bdu_urb->actual_length);
 	switch(bdu_urb->status)
 	{
 		case 0:	/* s'ha enviat amb exit el paquet */
-			up(&dev->sem);		// desbloqueja altres tasques que podrien estar esperant per enviar
+			BDU_COMPTAR(dev, urbs_completats, 1);
+			BDU_COMPTAR(dev, bytes_enviats, bdu_urb->actual_length);
+			dev->intents_recuperacio = 0;
+			if (ktime_to_ns(sortida->t_tecla))	// el paquet acaba l'eco d'una tecla
+			{
+				bdu_apuntar_latencia(dev, sortida->t_tecla);
+				if (ktime_to_ns(dev->t_represa))	// i es la primera despres de despertar
+				{
+					dev->latencia_represa_us = ktime_to_us(ktime_sub(ktime_get(), dev->t_represa));
+					dev->t_represa = ktime_set(0, 0);
+				}
+			}
 			break;	
 		case -ENOENT:
-			/* file or directory(dev) cannot be found */
-			err(" -> ERROR : NO es troba el dispositiu correcte\n");
+			/* file or directory(dev) cannot be found (o l'ha cancel·lat el driver: nomes queda a la traça) */
+			BDU_COMPTAR(dev, urbs_enoent, 1);
+			if (!dev->cancelant_sortides && dev->interface) err(" -> ERROR : NO es troba el dispositiu correcte\n");
 			break;
 		case -ECONNRESET:
-			/* connection reset by peer */
-			err(" -> ERROR : s'ha resetejat la connexio\n");
+			/* connection reset by peer (o l'ha cancel·lat el driver) */
+			BDU_COMPTAR(dev, urbs_econnreset, 1);
+			if (!dev->cancelant_sortides && dev->interface) err(" -> ERROR : s'ha resetejat la connexio\n");
 			break;
 		case -ESHUTDOWN:
 			/* cannot send after transport endpoint shutdown */
+			BDU_COMPTAR(dev, urbs_eshutdown, 1);
 			printk(KERN_INFO " -> ERROR : s'ha desconnectat el dispositiu\n");
-			usb_unlink_urb(bdu_urb);
 			break;
+		case -EPIPE:
+			/* el display ha aturat l'endpoint (STALL): cal desbloquejar-lo abans de tornar a enviar */
+			BDU_COMPTAR(dev, urbs_epipe, 1);
+			dev->endpoint_aturat = 1;
+			bdu_programar_recuperacio(dev);
+			break;
+		default:
+			/* error de transmissio (-EPROTO, -EILSEQ, -ETIME ...): el paquet s'ha perdut */
+			BDU_COMPTAR(dev, urbs_altres_errors, 1);
+			bdu_programar_recuperacio(dev);
+			break;
+	}
+	/* deixa anar la referencia que mantenia despert el dispositiu ('bdu_enviar_sortida') */
+	if (dev->interface)
+	{
+		usb_mark_last_busy(dev->udev);
+		usb_autopm_put_interface_async(dev->interface);
 	}
+
+	/* retorna l'entrada a l'anell i desbloqueja altres tasques que podrien estar esperant per enviar */
+	bdu_alliberar_sortida(dev, sortida);
 }
 
 
@@ -478,115 +1473,1607 @@ static void bdu_out_callback(struct urb *bdu_urb, struct pt_regs *regs)
 
 /**
  *	bdu_read: s'invoca quan una aplicacio demana informacio al driver (p.ex., amb crida a 'fread')
- *		Aquesta funcio actualment no fa res, pero hauria de retornar a l'aplicacio les tecles premudes.
+ *		Retorna a l'aplicacio totes les tecles premudes pendents (fins a 'count') amb una sola crida.
+ *		Si no n'hi ha cap, espera que se'n premi alguna (o retorna -EAGAIN amb O_NONBLOCK).
  */
 static ssize_t bdu_read(struct file *file, char *user_buffer, size_t count, loff_t *ppos)
 {
-	int retval= 0;
-	//struct bdusb *dev= (struct bdusb *) file->private_data;
+	struct bdu_obertura *obertura = (struct bdu_obertura *) file->private_data;
+	struct bdusb *dev = obertura->dev;
+	unsigned char tecles[MIDA_CUA_TECLES];
+	unsigned int copiats;
+	ssize_t retval;
 
-	printk(KERN_INFO "BDUSB: __bdu_read__\n");
+	if (count == 0) return 0;
+
+	if (mutex_lock_interruptible(&obertura->mutex_lectura))
+		return -ERESTARTSYS;
+	while (ACCESS_ONCE(dev->cap_tecles) == obertura->posicio)
+	{
+		mutex_unlock(&obertura->mutex_lectura);
+		if (!dev->interface) return -ENODEV;		// el dispositiu s'ha desconnectat
+		if (file->f_flags & O_NONBLOCK) return -EAGAIN;
+		if (wait_event_interruptible(dev->cua_lectura,
+				(ACCESS_ONCE(dev->cap_tecles) != obertura->posicio) || !dev->interface))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&obertura->mutex_lectura))
+			return -ERESTARTSYS;
+	}
+	/* copia de cop totes les tecles disponibles cap a l'aplicacio (nomes avança si arriben) */
+	copiats = bdu_copiar_tecles(dev, obertura, tecles, min_t(size_t, count, MIDA_CUA_TECLES));
+	if (copy_to_user(user_buffer, tecles, copiats))
+		retval = -EFAULT;
+	else
+	{
+		obertura->posicio += copiats;
+		retval = copiats;
+	}
+	mutex_unlock(&obertura->mutex_lectura);
 
+	trace_bdu_lectura(dev->minor, count, retval);
 	return retval;
 }
 
 
 
 /**
- *	bdu_in_callback: s'invoca quan el dispositiu envia un codi de tecla a l'ordinador a traves del cable USB
- *			(una interrupcio per tecla pitjada)
+ *	bdu_copiar_tecles: copia fins a 'max' tecles de l'anell a partir de la posicio de l'obertura
+ *		Si el lector s'ha endarrerit mes que la mida de l'anell, salta les tecles que s'han sobreescrit.
+ *		No bloqueja el productor ('bdu_in_callback'): llegeix el cap, copia i torna a llegir el cap per
+ *		descartar les tecles que s'hagin pogut sobreescriure mentre es copiaven.
  */
-static void bdu_in_callback(struct urb *bdu_urb, struct pt_regs *regs)
+static unsigned int bdu_copiar_tecles(struct bdusb *dev, struct bdu_obertura *obertura, unsigned char *tecles, unsigned int max)
 {
-	struct bdusb *dev = (struct bdusb *) bdu_urb->context;
+	unsigned int cap, i, n, perdudes;
+
+	cap = ACCESS_ONCE(dev->cap_tecles);
+	smp_rmb();		// les tecles fins a 'cap' ja son a l'anell
+	n = cap - obertura->posicio;
+	if (n > MIDA_CUA_TECLES)
+	{
+		BDU_COMPTAR(dev, tecles_perdudes, n - MIDA_CUA_TECLES);
+		obertura->posicio = cap - MIDA_CUA_TECLES;
+		n = MIDA_CUA_TECLES;
+	}
+	if (n > max) n = max;
+	for (i = 0; i < n; i++)
+		tecles[i] = dev->anell_tecles[(obertura->posicio + i) % MIDA_CUA_TECLES];
+
+	/* mentrestant el productor pot haver escrit a l'anell les tecles fins a 'cap' (inclosa la que
+	   encara no ha publicat): les copiades anteriors a 'cap - MIDA_CUA_TECLES + 1' no son fiables */
+	smp_rmb();		// la copia es fa abans de tornar a llegir el cap
+	cap = ACCESS_ONCE(dev->cap_tecles);
+	perdudes = cap - MIDA_CUA_TECLES + 1 - obertura->posicio;
+	if ((int) perdudes > 0)
+	{
+		if (perdudes > n) perdudes = n;
+		BDU_COMPTAR(dev, tecles_perdudes, perdudes);
+		memmove(tecles, &tecles[perdudes], n - perdudes);
+		obertura->posicio += perdudes;
+		n -= perdudes;
+	}
+	return n;
+}
 
-	printk(KERN_INFO "BDUSB: __bdu_in_callback__ codi (%c), status (%d) \n", dev->interrupt_in_buffer[0], bdu_urb->status);
 
-	/*Comprovem si s'ha rebut el paquet correctament */
-	switch (bdu_urb->status)
+
+/**
+ *	bdu_poll: s'invoca quan una aplicacio espera el dispositiu amb 'poll', 'select' o 'epoll'
+ */
+static unsigned int bdu_poll(struct file *file, poll_table *wait)
+{
+	struct bdu_obertura *obertura = (struct bdu_obertura *) file->private_data;
+	struct bdusb *dev = obertura->dev;
+	unsigned int mask = 0;
+
+	poll_wait(file, &dev->cua_lectura, wait);
+	poll_wait(file, &dev->cua_escriptura, wait);
+
+	if (ACCESS_ONCE(dev->cap_tecles) != obertura->posicio) mask |= POLLIN | POLLRDNORM;
+	if (bdu_hi_ha_sortida_lliure(dev) && dev->interface) mask |= POLLOUT | POLLWRNORM;
+	if (!dev->interface) mask |= POLLERR | POLLHUP;
+	return mask;
+}
+
+
+
+/**
+ *	bdu_refrescar: envia al display tots els canvis de 'desitjat', incloent-hi els fets a traves de 'mmap'
+ */
+static int bdu_refrescar(struct bdusb *dev)
+{
+	int retval;
+
+	if (mutex_lock_interruptible(&dev->mutex_pantalla))
+		return -ERESTARTSYS;
+	bdu_marcar_brut(dev, 0, dev->celles);		// no sabem quines cel·les ha tocat l'aplicacio
+	hrtimer_try_to_cancel(&dev->t_coalescencia);	// tambe s'envien les escriptures que esperaven
+	retval = bdu_sincronitzar(dev, 0);
+	if (retval == 0) retval = bdu_error_pendent(dev);
+	mutex_unlock(&dev->mutex_pantalla);
+	return retval;
+}
+
+
+
+/**
+ *	bdu_enviar_escriptura: envia els canvis d'una escriptura (amb 'mutex_pantalla' agafat)
+ *		Amb coalescencia, nomes s'envien de seguida si ja omplen un paquet; si no, s'engega l'espera
+ *		(sense allargar-la si ja estava en marxa) i s'enviaran juntament amb les escriptures seguents.
+ */
+static int bdu_enviar_escriptura(struct bdusb *dev, int no_bloquejar)
+{
+	int retval;
+
+	if ((dev->coalescencia_us == 0) || !dev->pantalla_valida ||
+	    (dev->brut_fi - dev->brut_inici >= (int) dev->bulk_out_size - 1))
 	{
-		case 0: /* tractar la tecla rebuda */
-			dev->codi_tecla = dev->interrupt_in_buffer[0];	// memoritza el codi ASCII de la tecla
-			schedule_work(&dev->t_teclat);			// envia el work a la cua de treballs del sistema
-
-			/* re-inicialitza l'urb de captacio de tecles */
-			usb_fill_int_urb(bdu_urb, dev->udev,
-					usb_rcvintpipe(dev->udev, dev->interrupt_in_endpointAddr),
-					dev->interrupt_in_buffer,
-					dev->interrupt_in_size,
-					(void*) bdu_in_callback, dev, 250);
-			/* i el torna a enviar */
-			if (usb_submit_urb(bdu_urb, GFP_ATOMIC)) err(" -> ERROR: no s'ha pogut reenviar l'urb de lectura\n");
-			break;	
-		case -ENOENT:
-			/* file or directory(dev) cannot be found */
-			err(" -> ERROR : NO es troba el dispositiu correcte\n");
-			break;
-		case -ECONNRESET:
-			/* connection reset by peer */
-			err(" -> ERROR : s'ha resetejat la connexio\n");
-			break;
-		case -ESHUTDOWN:
-			/* cannot send after transport endpoint shutdown */
-			printk(KERN_INFO " -> ERROR : s'ha desconnectat el dispositiu\n");
-			usb_unlink_urb(bdu_urb);
-			break;
+		hrtimer_try_to_cancel(&dev->t_coalescencia);
+		retval = bdu_sincronitzar(dev, no_bloquejar ? SINC_NO_BLOQUEJAR : 0);
+		/* sense entrades lliures, els canvis ja acceptats s'enviaran en alliberar-se'n una */
+		return (retval == -EAGAIN) ? 0 : retval;
 	}
+	if (!hrtimer_active(&dev->t_coalescencia))
+		hrtimer_start(&dev->t_coalescencia, ns_to_ktime((u64) dev->coalescencia_us * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+	return 0;
 }
 
 
 
-void Processar_tecla(struct work_struct *work)
+/**
+ *	bdu_fi_coalescencia: s'invoca (en context d'interrupcio) quan venç l'espera de coalescencia
+ */
+static enum hrtimer_restart bdu_fi_coalescencia(struct hrtimer *temporitzador)
 {
-	char c;
-	struct bdusb *dev = work_to_dev(work);		// obtenir l'adreça a l'estructura de dades del dispositiu
+	struct bdusb *dev = container_of(temporitzador, struct bdusb, t_coalescencia);
+
+	if (dev->interface) queue_work(dev->cua_treballs, &dev->t_buidar);		// l'enviament necessita 'mutex_pantalla': es fa des d'un treball
+	return HRTIMER_NORESTART;
+}
+
+
+
+/**
+ *	bdu_buidar: treball que envia les escriptures que esperaven a ajuntar-se
+ */
+static void bdu_buidar(struct work_struct *work)
+{
+	struct bdusb *dev = container_of(work, struct bdusb, t_buidar);
+	int retval;
+
+	/* sense esperar l'anell: si s'omple, 'bdu_alliberar_sortida' torna a programar aquest treball */
+	mutex_lock(&dev->mutex_pantalla);
+	retval = bdu_sincronitzar(dev, SINC_NO_BLOQUEJAR);
+	if (retval && (retval != -EAGAIN))
+		printk(KERN_INFO " -> ERROR: no s'han pogut enviar les escriptures pendents");
+	mutex_unlock(&dev->mutex_pantalla);
+}
 
-	c = dev->codi_tecla;
-	if ((c == 'F') && (dev->col_actual > 0))	// tecla d'esborrat d'ultim caracter
+
+
+/**
+ *	bdu_carregar_animacio: comença (o atura, amb longitud 0) l'animacio d'una fila (BDU_IOC_ANIMAR)
+ */
+static long bdu_carregar_animacio(struct bdusb *dev, const struct bdu_animacio *a)
+{
+	struct bdu_fila_animada *anim;
+	unsigned char *text = NULL;
+	ktime_t ara;
+	int retval;
+
+	if ((a->longitud > BDU_ANIMACIO_MAX_TEXT) || (a->fila >= NUM_FILES_MAX)) return -EINVAL;
+	if (a->longitud)
 	{
-		if (down_interruptible(&dev->sem) == 0)
+		if ((a->pas_ms && ((a->pas_ms < BDU_ANIMACIO_MIN_MS) || ((a->direccio != 1) && (a->direccio != -1)))) ||
+		    (a->parpelleig_ms && (a->parpelleig_ms < BDU_ANIMACIO_MIN_MS)))
+			return -EINVAL;
+		text = kmalloc(a->longitud, GFP_KERNEL);
+		if (!text) return -ENOMEM;
+		if (copy_from_user(text, (void *) (unsigned long) a->text, a->longitud))
 		{
-			dev->bulk_out_buffer[0] = 0x00;	// preparem un paquet de comandes
-			dev->col_actual--;		// decrementa la posicio del cursor en u
-			dev->bulk_out_buffer[1] = 0x80 + dev->col_actual;	// comanda de posicionament del cursor
-			usb_fill_bulk_urb(dev->urb_out_display, dev->udev,
-					usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-					dev->bulk_out_buffer, 2, (void*) bdu_out_callback, dev);
-			if (usb_submit_urb(dev->urb_out_display, GFP_ATOMIC)) printk(KERN_INFO "ERROR Processar tecla 1");
+			kfree(text);
+			return -EFAULT;
 		}
-		if (down_interruptible(&dev->sem) == 0)
+	}
+
+	if (mutex_lock_interruptible(&dev->mutex_pantalla))
+	{
+		kfree(text);
+		return -ERESTARTSYS;
+	}
+	if (!dev->interface || (a->fila >= dev->files))
+	{
+		mutex_unlock(&dev->mutex_pantalla);
+		kfree(text);
+		return dev->interface ? -EINVAL : -ENODEV;
+	}
+	anim = &dev->animacions[a->fila];
+	kfree(anim->text);
+	anim->text = text;
+	retval = 0;
+	if (text)
+	{
+		ara = ktime_get();
+		anim->longitud = a->longitud;
+		anim->posicio = 0;
+		anim->direccio = a->direccio;
+		anim->pas_ms = a->pas_ms;
+		anim->parpelleig_ms = a->parpelleig_ms;
+		anim->visible = 1;
+		anim->seguent_pas = ktime_add_ns(ara, (u64) anim->pas_ms * NSEC_PER_MSEC);
+		anim->seguent_parpelleig = ktime_add_ns(ara, (u64) anim->parpelleig_ms * NSEC_PER_MSEC);
+		bdu_pintar_animacio(dev, a->fila);
+		retval = bdu_sincronitzar(dev, SINC_CURSOR);
+	}
+	mutex_unlock(&dev->mutex_pantalla);
+
+	/* el treball programa el temporitzador per al proper pas */
+	if (text) queue_work(dev->cua_treballs, &dev->t_animar);
+	return retval;
+}
+
+
+
+/**
+ *	bdu_fi_animacio: s'invoca (en context d'interrupcio) quan venç el proper pas d'alguna animacio
+ */
+static enum hrtimer_restart bdu_fi_animacio(struct hrtimer *temporitzador)
+{
+	struct bdusb *dev = container_of(temporitzador, struct bdusb, t_animacio);
+
+	if (dev->interface) queue_work(dev->cua_treballs, &dev->t_animar);
+	return HRTIMER_NORESTART;
+}
+
+
+
+/**
+ *	bdu_animar: treball que fa els passos vençuts de totes les animacions, n'envia nomes les cel·les
+ *		que canvien i programa el temporitzador per al proper pas. L'enviament no espera entrades de
+ *		l'anell: si el display va endarrerit, els passos intermedis es fusionen en l'ultim.
+ */
+static void bdu_animar(struct work_struct *work)
+{
+	struct bdusb *dev = container_of(work, struct bdusb, t_animar);
+	struct bdu_fila_animada *anim;
+	ktime_t ara, proper;
+	int f, canvi, hi_ha_canvis = 0, hi_ha_animacions = 0;
+
+	mutex_lock(&dev->mutex_pantalla);
+	ara = ktime_get();
+	proper = ktime_add_ns(ara, (u64) NSEC_PER_SEC * 3600);
+	for (f = 0; f < dev->files; f++)
+	{
+		anim = &dev->animacions[f];
+		if (!anim->text) continue;
+		canvi = 0;
+		if (anim->pas_ms && (ktime_to_ns(ktime_sub(anim->seguent_pas, ara)) <= 0))
 		{
-			dev->bulk_out_buffer[0] = 0x01;	// preparem un paquet de dades
-			dev->bulk_out_buffer[1] = ' ';	// enviarem un espai en blanc per esborrar caracter anterior
-			usb_fill_bulk_urb(dev->urb_out_display, dev->udev,
-					usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-					dev->bulk_out_buffer, 2, (void*) bdu_out_callback, dev);
-			if (usb_submit_urb(dev->urb_out_display, GFP_ATOMIC)) printk(KERN_INFO "ERROR Processar tecla 2");
-			dev->col_actual++;		// apuntem el desplaçament automatic del cursor
+			anim->posicio = (anim->posicio + anim->direccio + anim->longitud) % anim->longitud;
+			anim->seguent_pas = ktime_add_ns(ara, (u64) anim->pas_ms * NSEC_PER_MSEC);
+			canvi = 1;
 		}
-		if (down_interruptible(&dev->sem) == 0)
+		if (anim->parpelleig_ms && (ktime_to_ns(ktime_sub(anim->seguent_parpelleig, ara)) <= 0))
 		{
-			dev->bulk_out_buffer[0] = 0x00;	// preparem un paquet de comandes
-			dev->col_actual--;		// recuperem la posicio del cursor despres de l'esborrat
-			dev->bulk_out_buffer[1] = 0x80 + dev->col_actual;	// comanda de posicionament del cursor
-			usb_fill_bulk_urb(dev->urb_out_display, dev->udev,
-					usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-					dev->bulk_out_buffer, 2, (void*) bdu_out_callback, dev);
-			if (usb_submit_urb(dev->urb_out_display, GFP_ATOMIC)) printk(KERN_INFO "ERROR Processar tecla 3");
+			anim->visible = !anim->visible;
+			anim->seguent_parpelleig = ktime_add_ns(ara, (u64) anim->parpelleig_ms * NSEC_PER_MSEC);
+			canvi = 1;
 		}
-	}
-	else if ((c != 'F') && (dev->col_actual < 16))
-	{	// envia al display la tecla premuda
-		if (down_interruptible(&dev->sem) == 0)
+		if (canvi)
 		{
-			dev->bulk_out_buffer[0] = 0x01;	// preparem un paquet de dades
-			dev->bulk_out_buffer[1] = c;
-			usb_fill_bulk_urb(dev->urb_out_display, dev->udev,
-					usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-					dev->bulk_out_buffer, 2, (void*) bdu_out_callback, dev);
-			if (usb_submit_urb(dev->urb_out_display, GFP_ATOMIC)) printk(KERN_INFO "ERROR Processar tecla 4");
-			dev->col_actual++;		// apuntem el desplaçament automatic del cursor
+			bdu_pintar_animacio(dev, f);
+			hi_ha_canvis = 1;
 		}
+		/* el proper venciment es el mes proxim de tots */
+		if (anim->pas_ms && (ktime_to_ns(ktime_sub(anim->seguent_pas, proper)) < 0))
+			proper = anim->seguent_pas;
+		if (anim->parpelleig_ms && (ktime_to_ns(ktime_sub(anim->seguent_parpelleig, proper)) < 0))
+			proper = anim->seguent_parpelleig;
+		if (anim->pas_ms || anim->parpelleig_ms) hi_ha_animacions = 1;
+	}
+	/* si no hi ha entrades lliures, la resta s'enviara des de 'bdu_buidar' quan el display n'alliberi */
+	if (hi_ha_canvis) bdu_sincronitzar(dev, SINC_CURSOR | SINC_NO_BLOQUEJAR);
+	if (hi_ha_animacions && dev->interface) hrtimer_start(&dev->t_animacio, proper, HRTIMER_MODE_ABS);
+	mutex_unlock(&dev->mutex_pantalla);
+}
+
+
+
+/**
+ *	bdu_pintar_animacio: copia a 'desitjat' la part visible del text animat d'una fila
+ *		(amb 'mutex_pantalla' agafat)
+ */
+static void bdu_pintar_animacio(struct bdusb *dev, int fila)
+{
+	struct bdu_fila_animada *anim = &dev->animacions[fila];
+	unsigned char *desti = &dev->desitjat[fila * dev->columnes];
+	int c;
+
+	for (c = 0; c < dev->columnes; c++)
+		desti[c] = anim->visible ? anim->text[(anim->posicio + c) % anim->longitud] : ' ';
+	bdu_marcar_brut(dev, fila * dev->columnes, (fila + 1) * dev->columnes);
+}
+
+
+
+/**
+ *	bdu_aturar_animacions: atura les animacions de totes les files (amb 'mutex_pantalla' agafat)
+ *		El temporitzador pot vencer encara un cop, pero el treball ja no trobara res per animar.
+ */
+static void bdu_aturar_animacions(struct bdusb *dev)
+{
+	int f;
+
+	for (f = 0; f < NUM_FILES_MAX; f++)
+	{
+		kfree(dev->animacions[f].text);
+		dev->animacions[f].text = NULL;
+	}
+}
+
+
+
+/**
+ *	bdu_apuntar_latencia: afegeix a l'histograma el temps des de l'arribada d'una tecla fins al seu eco
+ *		(s'invoca des de 'bdu_out_callback'). La franja 0 es per sota d'1 us; la franja k, de 2^(k-1) a 2^k us.
+ */
+static void bdu_apuntar_latencia(struct bdusb *dev, ktime_t inici)
+{
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), inici));
+	int franja = (us > 0) ? ilog2(us) + 1 : 0;
+
+	if (franja >= NUM_FRANGES_LATENCIA) franja = NUM_FRANGES_LATENCIA - 1;
+	dev->latencia_eco[franja]++;
+}
+
+
+
+/**
+ *	bdu_ioctl: s'invoca quan una aplicacio envia una comanda al driver amb 'ioctl' (veure 'botodispusb.h')
+ */
+static long bdu_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct bdusb *dev = file_to_dev(file);
+	struct bdu_difusio difusio;
+	struct bdu_operacions ops;
+	struct bdu_animacio animacio;
+	struct bdu_glif glif;
+	struct bdu_accions *accions;
+	long retval;
+
+	/* totes les comandes canvien el display */
+	if (!(file->f_mode & FMODE_WRITE)) return -EBADF;
+
+	switch (cmd)
+	{
+		case BDU_IOC_REFRESCAR:
+			return bdu_refrescar(dev);
+		case BDU_IOC_DIFONDRE:
+			if (copy_from_user(&difusio, (void *) arg, sizeof(difusio))) return -EFAULT;
+			return bdu_difondre(file, &difusio);
+		case BDU_IOC_OPERACIONS:
+			if (copy_from_user(&ops, (void *) arg, sizeof(ops))) return -EFAULT;
+			return bdu_executar_operacions(file, &ops);
+		case BDU_IOC_ANIMAR:
+			if (copy_from_user(&animacio, (void *) arg, sizeof(animacio))) return -EFAULT;
+			return bdu_carregar_animacio(dev, &animacio);
+		case BDU_IOC_GLIF:
+			if (copy_from_user(&glif, (void *) arg, sizeof(glif))) return -EFAULT;
+			return bdu_definir_glif(dev, &glif);
+		case BDU_IOC_ACCIONS:
+			accions = kmalloc(sizeof(*accions), GFP_KERNEL);
+			if (!accions) return -ENOMEM;
+			retval = copy_from_user(accions, (void *) arg, sizeof(*accions)) ? -EFAULT : bdu_carregar_accions(dev, accions);
+			kfree(accions);
+			return retval;
+	}
+	return -ENOTTY;
+}
+
+
+
+/**
+ *	bdu_obtenir_dispositiu: retorna el 'dev' del dispositiu amb el minor indicat, amb una referencia
+ *		agafada (s'ha d'alliberar amb 'kref_put'), o NULL si no n'hi ha cap o s'esta desconnectant
+ */
+static struct bdusb *bdu_obtenir_dispositiu(int minor)
+{
+	struct usb_interface *interface;
+	struct bdusb *dev = NULL;
+
+	mutex_lock(&bdu_mutex_dispositius);
+	interface = usb_find_interface(&bdu_driver, minor);
+	if (interface) dev = usb_get_intfdata(interface);
+	if (dev) kref_get(&dev->bdu_refcount);
+	mutex_unlock(&bdu_mutex_dispositius);
+	return dev;
+}
+
+
+
+/**
+ *	bdu_pot_escriure: indica si des de 'file' es pot escriure a 'dev' (no, si un altre en es l'escriptor exclusiu)
+ */
+static int bdu_pot_escriure(struct bdusb *dev, struct file *file)
+{
+	struct bdu_obertura *obertura = (struct bdu_obertura *) file->private_data;
+
+	return (atomic_read(&dev->escriptors) != ESCRIPTOR_EXCLUSIU) ||
+		((obertura->dev == dev) && (obertura->escriptor == ESCRIPTOR_EXCLUSIU));
+}
+
+
+
+/**
+ *	bdu_difondre: escriu el mateix text a tots els displays indicats (BDU_IOC_DIFONDRE)
+ *		El text i la llista es copien una sola vegada. Cada display s'actualitza sense esperar entrades
+ *		lliures del seu anell (el que no hi cap s'envia en alliberar-se'n), de manera que els urbs de tots
+ *		els displays queden en curs alhora. Retorna el numero de displays actualitzats.
+ */
+static long bdu_difondre(struct file *file, const struct bdu_difusio *d)
+{
+	int no_bloquejar = file->f_flags & O_NONBLOCK;
+	unsigned char *text = NULL;
+	__s32 *fds = NULL;
+	__s32 *resultats = NULL;
+	struct file *desti;
+	struct bdusb *dev;
+	struct bdu_escriptura e;
+	int i, retval, actualitzats = 0;
+
+	if ((d->longitud > BDU_DIFUSIO_MAX_TEXT) || (d->num_fds > BDU_DIFUSIO_MAX_DISP)) return -EINVAL;
+	if (d->num_fds == 0) return 0;
+
+	text = kmalloc(d->longitud + 1, GFP_KERNEL);
+	fds = kmalloc(d->num_fds * sizeof(__s32), GFP_KERNEL);
+	resultats = kmalloc(d->num_fds * sizeof(__s32), GFP_KERNEL);
+	if (!text || !fds || !resultats)
+	{
+		retval = -ENOMEM;
+		goto sortir;
+	}
+	if (copy_from_user(text, (void *) (unsigned long) d->text, d->longitud) ||
+	    copy_from_user(fds, (void *) (unsigned long) d->fds, d->num_fds * sizeof(__s32)))
+	{
+		retval = -EFAULT;
+		goto sortir;
+	}
+	if (bdu_escapades_finals(text, d->longitud) & 1)
+	{	/* escapada sense id de glif (veure 'bdu_escriure_celles') */
+		retval = -EINVAL;
+		goto sortir;
+	}
+
+	for (i = 0; i < d->num_fds; i++)
+	{
+		/* nomes displays que l'aplicacio ja te oberts per escriure: els permisos son els de cada node.
+		   Mentre es te el 'file', l'obertura (i la seva referencia a 'dev') no es pot alliberar */
+		desti = fget(fds[i]);
+		if (!desti || (desti->f_op != &bdu_fops))
+		{
+			if (desti) fput(desti);
+			resultats[i] = -EBADF;
+			continue;
+		}
+		dev = file_to_dev(desti);
+		if (!(desti->f_mode & FMODE_WRITE))
+			retval = -EBADF;
+		else
+			retval = bdu_pot_escriure(dev, desti) ? bdu_comencar_escriptura(dev, no_bloquejar) : -EBUSY;
+		if (retval == 0)
+		{
+			e.cella = (d->posicio < 0) ? dev->cursor : d->posicio;
+			e.fila_plena = 0;
+			e.escapada = 0;
+			if (e.cella > dev->celles)
+				retval = -EINVAL;
+			else
+			{
+				bdu_escriure_bloc(dev, &e, text, d->longitud);
+				dev->cursor = e.cella;
+				retval = bdu_enviar_escriptura(dev, 1);	// no espera: els altres displays van en paral·lel
+			}
+			mutex_unlock(&dev->mutex_pantalla);
+		}
+		if (retval == 0)
+		{
+			BDU_COMPTAR(dev, bytes_escrits, d->longitud);
+			actualitzats++;
+		}
+		resultats[i] = retval;
+		fput(desti);
+	}
+
+	retval = actualitzats;
+	if (d->resultats && copy_to_user((void *) (unsigned long) d->resultats, resultats, d->num_fds * sizeof(__s32)))
+		retval = -EFAULT;
+sortir:
+	kfree(text);
+	kfree(fds);
+	kfree(resultats);
+	return retval;
+}
+
+
+
+/**
+ *	bdu_executar_operacions: executa en ordre un lot d'operacions sobre el display (BDU_IOC_OPERACIONS)
+ *		Cursor, text i esborrat nomes canvien la copia del display; les comandes s'afegeixen al paquet en
+ *		construccio despres dels canvis anteriors. Al final s'envien els canvis que queden i es deixa el
+ *		cursor on indiquen les operacions, tot en els minims paquets. Si una operacio falla, s'envia el que
+ *		han fet les anteriors i es retorna el seu error.
+ *		Amb O_NONBLOCK no s'espera l'anell de sortida: si s'omple, les cel·les canviades s'acaben d'enviar
+ *		en alliberar-se entrades (com 'write'), pero una comanda no s'envia si els seus paquets no hi caben;
+ *		llavors es retorna el nombre d'operacions fetes fins aleshores (-EAGAIN si no se n'ha fet cap).
+ */
+static long bdu_executar_operacions(struct file *file, const struct bdu_operacions *ops)
+{
+	struct bdusb *dev = file_to_dev(file);
+	struct bdu_lot lot;
+	struct bdu_operacio *op = NULL;
+	unsigned char bloc[64];
+	size_t fets, n;
+	ssize_t escrits;
+	int i, retval, paquets, aturat = 0, error = 0;
+
+	if (ops->num_operacions > BDU_OPERACIONS_MAX) return -EINVAL;
+	if (ops->num_operacions == 0) return 0;
+
+	op = kmalloc(ops->num_operacions * sizeof(struct bdu_operacio), GFP_KERNEL);
+	if (!op) return -ENOMEM;
+	if (copy_from_user(op, (void *) (unsigned long) ops->operacions, ops->num_operacions * sizeof(struct bdu_operacio)))
+	{
+		kfree(op);
+		return -EFAULT;
+	}
+
+	retval = bdu_comencar_escriptura(dev, file->f_flags & O_NONBLOCK);
+	if (retval)
+	{
+		kfree(op);
+		return retval;
+	}
+	hrtimer_try_to_cancel(&dev->t_coalescencia);	// les escriptures pendents surten amb aquest lot
+	bdu_lot_iniciar(dev, &lot, file->f_flags & O_NONBLOCK);
+
+	for (i = 0; i < ops->num_operacions; i++)
+	{
+		switch (op[i].tipus)
+		{
+			case BDU_OP_CURSOR:
+				if (op[i].valor > dev->celles) error = -EINVAL;
+				else dev->cursor = op[i].valor;
+				break;
+			case BDU_OP_TEXT:
+				if (op[i].longitud > BDU_OPERACIO_MAX_DADES)
+				{
+					error = -EINVAL;
+					break;
+				}
+				escrits = bdu_escriure_celles(dev, dev->cursor, (const char *) (unsigned long) op[i].dades, op[i].longitud);
+				if (escrits < 0) error = escrits;
+				else if (escrits > 0) BDU_COMPTAR(dev, bytes_escrits, escrits);
+				break;
+			case BDU_OP_NETEJAR:
+				/* amb la copia invalida, la sincronitzacio comença amb la comanda d'esborrat */
+				memset(dev->desitjat, ' ', dev->celles);
+				dev->pantalla_valida = 0;
+				dev->cursor = 0;
+				break;
+			case BDU_OP_COMANDA:
+				/* sense bloquejar, una comanda no pot quedar a mitges: nomes s'hi posa si hi caben tots els
+				   paquets, i una que no cap ni a l'anell buit no s'hi posara mai */
+				paquets = DIV_ROUND_UP(op[i].longitud, dev->bulk_out_size - 1);
+				if ((op[i].longitud > BDU_OPERACIO_MAX_DADES) || (lot.no_bloquejar && (paquets > dev->num_sortides)))
+				{
+					error = -EINVAL;
+					break;
+				}
+				/* primer els canvis anteriors, perque la comanda els trobi fets */
+				error = bdu_afegir_canvis(dev, &lot, 0);
+				if (error) break;
+				if (lot.no_bloquejar && (bdu_sortides_lliures(dev) < paquets))
+				{
+					aturat = 1;
+					break;
+				}
+				for (fets = 0; (fets < op[i].longitud) && !error; fets += n)
+				{
+					n = min_t(size_t, op[i].longitud - fets, sizeof(bloc));
+					if (copy_from_user(bloc, (const char *) (unsigned long) op[i].dades + fets, n))
+					{
+						error = -EFAULT;
+						break;
+					}
+					error = bdu_cod_afegir_bytes(&lot.cod, TIPUS_COMANDA, bloc, n, NULL);
+				}
+				dev->col_display = -1;	// no sabem on ha deixat el cursor la comanda
+				break;
+			default:
+				error = -EINVAL;
+				break;
+		}
+		if (error || aturat) break;	// 'i' son les operacions fetes
+	}
+
+	/* envia el que queda, tambe si una operacio era incorrecta (el que han fet les anteriors es valid);
+	   si el que ha fallat es un enviament, nomes cal tractar-ne l'error */
+	if (error && (error != -EINVAL) && (error != -EFAULT))
+		retval = error;
+	else
+	{
+		retval = bdu_afegir_canvis(dev, &lot, SINC_CURSOR);
+		if (retval == 0) retval = bdu_cod_enviar(&lot.cod);
+	}
+	retval = bdu_acabar_sincronitzacio(dev, retval);
+	mutex_unlock(&dev->mutex_pantalla);
+	kfree(op);
+
+	/* sense entrades lliures, les cel·les ja canviades s'enviaran en alliberar-se'n una */
+	if ((error == -EAGAIN) || aturat) return i ? i : -EAGAIN;
+	if (error) return error;
+	return ((retval == 0) || (retval == -EAGAIN)) ? ops->num_operacions : retval;
+}
+
+
+
+/**
+ *	bdu_mmap: s'invoca quan una aplicacio projecta el dispositiu a memoria (amb crida a 'mmap')
+ *		Es projecta la pagina amb el contingut desitjat del display, una cel·la per byte.
+ *		Els canvis s'envien al display amb BDU_IOC_REFRESCAR o 'msync' (veure 'bdu_fsync').
+ */
+static int bdu_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct bdusb *dev = file_to_dev(file);
+
+	if ((vma->vm_pgoff != 0) || (vma->vm_end - vma->vm_start > PAGE_ALIGN(MAX_CELLES)))
+		return -EINVAL;
+	return remap_vmalloc_range(vma, dev->desitjat, 0);
+}
+
+
+
+/**
+ *	bdu_fsync: s'invoca amb 'fsync' o amb 'msync(MS_SYNC)' sobre una projeccio del dispositiu
+ */
+static int bdu_fsync(struct file *file, int datasync)
+{
+	struct bdusb *dev = file_to_dev(file);
+
+	return bdu_refrescar(dev);
+}
+
+
+
+/**
+ *	bdu_in_callback: s'invoca quan el dispositiu envia un codi de tecla a l'ordinador a traves del cable USB
+ *			(una interrupcio per tecla pitjada)
+ */
+static void bdu_in_callback(struct urb *bdu_urb, struct pt_regs *regs)
+{
+	struct bdusb *dev = (struct bdusb *) bdu_urb->context;
+	unsigned char tecla;
+
+	unsigned char *buffer = bdu_urb->transfer_buffer;
+
+	trace_bdu_tecla(dev->minor, buffer[0], bdu_urb->status);
+
+	/*Comprovem si s'ha rebut el paquet correctament */
+	switch (bdu_urb->status)
+	{
+		case 0: /* tractar la tecla rebuda */
+			tecla = buffer[0];				// codi ASCII de la tecla
+			/* la memoritza per als lectors i els desperta (si la cua es plena, es perd) */
+			BDU_COMPTAR(dev, tecles_rebudes, 1);
+			usb_mark_last_busy(dev->udev);
+			if (ktime_to_ns(dev->t_represa) &&
+			    (ktime_to_us(ktime_sub(ktime_get(), dev->t_represa)) > TEMPS_DESPERTAR_MS * 1000))
+				dev->t_represa = ktime_set(0, 0);	// no es la tecla que ha despertat el dispositiu
+			bdu_informar_tecla(dev, tecla);
+			dev->anell_tecles[dev->cap_tecles % MIDA_CUA_TECLES] = tecla;
+			smp_wmb();	// publica la tecla abans del cap: qui veu el cap nou ja la troba a l'anell
+			ACCESS_ONCE(dev->cap_tecles) = dev->cap_tecles + 1;
+			wake_up_interruptible(&dev->cua_lectura);
+			/* i per al treball que la mostra al display (apuntant quan ha arribat la primera pendent) */
+			if (kfifo_is_empty(&dev->tecles_eco)) dev->t_tecla = ktime_get();
+			if (!kfifo_put(&dev->tecles_eco, &tecla)) BDU_COMPTAR(dev, tecles_perdudes, 1);
+			queue_work(dev->cua_treballs, &dev->t_teclat);	// envia el work a la cua de treballs del dispositiu
+
+			/* si l'interval s'adapta i ara era el de repos, passa a sondejar rapid */
+			dev->darrera_tecla = jiffies;
+			if (dev->interval_actiu && (dev->interval_programat != dev->interval_actiu) && dev->interface)
+				queue_delayed_work(dev->cua_treballs, &dev->t_interval, 0);
+
+			/* torna a enviar l'urb de captacio de tecles (els altres continuen esperant) */
+			if (bdu_enviar_entrada(dev, bdu_urb, GFP_ATOMIC)) err(" -> ERROR: no s'ha pogut reenviar l'urb de lectura\n");
+			break;	
+		case -ENOENT:
+			/* file or directory(dev) cannot be found (o l'urb s'ha cancel·lat per canviar l'interval o per dormir) */
+			if (!dev->reprogramant && !dev->suspes) err(" -> ERROR : NO es troba el dispositiu correcte\n");
+			break;
+		case -ECONNRESET:
+			/* connection reset by peer */
+			err(" -> ERROR : s'ha resetejat la connexio\n");
+			break;
+		case -ESHUTDOWN:
+			/* cannot send after transport endpoint shutdown */
+			printk(KERN_INFO " -> ERROR : s'ha desconnectat el dispositiu\n");
+			usb_unlink_urb(bdu_urb);
+			break;
+		default:
+			/* error transitori (-EPROTO, -EILSEQ, -ETIME, -EOVERFLOW ...): ja ha quedat al punt de traça.
+			   Es torna a enviar l'urb, perque si no el teclat perdria un dels urbs de captacio per sempre */
+			if (dev->interface && !dev->suspes && bdu_enviar_entrada(dev, bdu_urb, GFP_ATOMIC))
+				err(" -> ERROR: no s'ha pogut reenviar l'urb de lectura\n");
+			break;
+	}
+}
+
+
+
+/**
+ *	Processar_tecla: treball que mostra al display les tecles premudes pendents (o esborra el caracter anterior amb la 'F')
+ */
+void Processar_tecla(struct work_struct *work)
+{
+	unsigned char c;
+	int retval;
+	struct bdusb *dev = work_to_dev(work);		// obtenir l'adreça a l'estructura de dades del dispositiu
+
+	mutex_lock(&dev->mutex_pantalla);
+	dev->t_eco = dev->t_tecla;		// l'ultim paquet de l'eco portara l'hora d'arribada
+	/* tracta totes les tecles pendents, en l'ordre en que s'han premut */
+	while (kfifo_get(&dev->tecles_eco, &c))
+		bdu_executar_accio(dev, c);
+	/* envia tots els canvis de cop i deixa el cursor del display on toca. No s'espera l'anell: la cua de
+	   treballs es compartida amb la recuperacio, i el que no hi cap ho envia 'bdu_buidar' */
+	retval = bdu_sincronitzar(dev, SINC_CURSOR | SINC_NO_BLOQUEJAR);
+	if (retval && (retval != -EAGAIN)) printk(KERN_INFO "ERROR Processar tecla");
+	dev->t_eco = ktime_set(0, 0);
+	mutex_unlock(&dev->mutex_pantalla);
+}
+
+
+
+/**
+ *	bdu_executar_accio: fa a la copia del display l'accio associada a una tecla (amb 'mutex_pantalla' agafat)
+ */
+static void bdu_executar_accio(struct bdusb *dev, unsigned char tecla)
+{
+	struct bdu_accio_tecla *a;
+	struct bdu_escriptura e;
+	int accio = (tecla < BDU_NUM_TECLES) ? dev->accions[tecla].accio : BDU_ACCIO_ECO;
+
+	switch (accio)
+	{
+		case BDU_ACCIO_ECO:		// mostra al display la tecla premuda
+			if (dev->cursor >= dev->celles) break;
+			dev->desitjat[dev->cursor] = tecla;
+			bdu_marcar_brut(dev, dev->cursor, dev->cursor + 1);
+			dev->cursor++;		// apuntem el desplaçament automatic del cursor
+			break;
+		case BDU_ACCIO_ESBORRAR:	// tecla d'esborrat d'ultim caracter
+			if (dev->cursor == 0) break;
+			dev->cursor--;		// decrementa la posicio del cursor en u
+			dev->desitjat[dev->cursor] = ' ';	// un espai en blanc esborra el caracter anterior
+			bdu_marcar_brut(dev, dev->cursor, dev->cursor + 1);
+			break;
+		case BDU_ACCIO_NETEJAR:		// amb la copia invalida, s'envia una sola comanda d'esborrat
+			memset(dev->desitjat, ' ', dev->celles);
+			dev->pantalla_valida = 0;
+			dev->cursor = 0;
+			break;
+		case BDU_ACCIO_CURSOR:
+			dev->cursor = clamp(dev->cursor + dev->accions[tecla].parametre, 0, dev->celles);
+			break;
+		case BDU_ACCIO_MACRO:
+			a = &dev->accions[tecla];
+			e.cella = dev->cursor;
+			e.fila_plena = 0;
+			e.escapada = 0;
+			bdu_escriure_bloc(dev, &e, a->macro, a->longitud);
+			dev->cursor = e.cella;
+			break;
+		case BDU_ACCIO_NOMES_LECTOR:
+		default:
+			break;
+	}
+}
+
+
+
+/**
+ *	bdu_carregar_accions: substitueix la taula d'accions de les tecles (BDU_IOC_ACCIONS)
+ */
+static long bdu_carregar_accions(struct bdusb *dev, const struct bdu_accions *accions)
+{
+	int i;
+
+	for (i = 0; i < BDU_NUM_TECLES; i++)
+		if ((accions->tecles[i].accio > BDU_ACCIO_MACRO) || (accions->tecles[i].longitud > BDU_MACRO_MAX) ||
+		    ((accions->tecles[i].accio == BDU_ACCIO_MACRO) &&
+		     (bdu_escapades_finals(accions->tecles[i].macro, accions->tecles[i].longitud) & 1)))
+			return -EINVAL;
+
+	if (mutex_lock_interruptible(&dev->mutex_pantalla)) return -ERESTARTSYS;
+	memcpy(dev->accions, accions->tecles, sizeof(dev->accions));
+	mutex_unlock(&dev->mutex_pantalla);
+	return 0;
+}
+
+
+
+/**
+ *	bdu_crear_buffers: demana el bloc DMA coherent amb els buffers de tots els urbs (s'invoca des de 'bdu_probe')
+ *		Tambe fixa quants urbs de sortida i d'entrada tindra el dispositiu.
+ */
+static int bdu_crear_buffers(struct bdusb *dev)
+{
+	dev->num_sortides = clamp(num_urbs_sortida, 1, NUM_URBS_SORTIDA_MAX);
+	dev->num_entrades = clamp(num_urbs_entrada, 1, NUM_URBS_ENTRADA_MAX);
+	dev->mida_buffers = dev->num_sortides * dev->bulk_out_size + dev->num_entrades * dev->interrupt_in_size;
+	dev->buffers = usb_alloc_coherent(dev->udev, dev->mida_buffers, GFP_KERNEL, &dev->buffers_dma);
+	return dev->buffers ? 0 : -ENOMEM;
+}
+
+
+
+/**
+ *	bdu_crear_sortides: crea l'anell d'urbs de sortida cap al display (s'invoca des de 'bdu_probe')
+ *		Cada urb queda preparat amb el seu tros de 'buffers'; per enviar nomes cal posar-hi la longitud.
+ *		Totes les entrades queden lliures i el semafor 'sem' en compta tantes com n'hi ha.
+ */
+static int bdu_crear_sortides(struct bdusb *dev)
+{
+	struct urb *urb;
+	int i;
+
+	dev->sortides = kzalloc(dev->num_sortides * sizeof(struct bdu_sortida), GFP_KERNEL);
+	if (!dev->sortides) return -ENOMEM;
+
+	for (i = 0; i < dev->num_sortides; i++)
+	{
+		dev->sortides[i].dev = dev;
+		dev->sortides[i].buffer = dev->buffers + i * dev->bulk_out_size;
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) return -ENOMEM;
+		usb_fill_bulk_urb(urb, dev->udev,
+				usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+				dev->sortides[i].buffer, dev->bulk_out_size, (void*) bdu_out_callback, &dev->sortides[i]);
+		urb->transfer_dma = dev->buffers_dma + i * dev->bulk_out_size;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		dev->sortides[i].urb = urb;
+		dev->sortides[i].seguent = (i + 1 < dev->num_sortides) ? i + 1 : -1;
+	}
+	dev->primera_lliure = 0;
+	spin_lock_init(&dev->lock_sortides);
+	init_usb_anchor(&dev->anchor_sortida);
+	sema_init(&dev->sem, dev->num_sortides);
+	init_waitqueue_head(&dev->cua_escriptura);
+	return 0;
+}
+
+
+
+/**
+ *	bdu_crear_entrades: crea els urbs per captar tecles pel interrupt_in_endpoint (amb els seus trossos de 'buffers')
+ */
+static int bdu_crear_entrades(struct bdusb *dev)
+{
+	size_t desplacament;
+	int i;
+
+	for (i = 0; i < dev->num_entrades; i++)
+	{
+		desplacament = dev->num_sortides * dev->bulk_out_size + i * dev->interrupt_in_size;
+		dev->urbs_entrada[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!dev->urbs_entrada[i]) return -ENOMEM;
+		usb_fill_int_urb(dev->urbs_entrada[i], dev->udev,
+				usb_rcvintpipe(dev->udev, dev->interrupt_in_endpointAddr),
+				dev->buffers + desplacament, dev->interrupt_in_size,
+				(void*) bdu_in_callback, dev, INTERVAL_TECLAT_DEF);
+		dev->urbs_entrada[i]->transfer_dma = dev->buffers_dma + desplacament;
+		dev->urbs_entrada[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+	init_usb_anchor(&dev->anchor_entrada);
+	return 0;
+}
+
+
+
+/**
+ *	bdu_enviar_entrada: envia (o torna a enviar) un urb de captacio de tecles amb l'interval programat
+ */
+static int bdu_enviar_entrada(struct bdusb *dev, struct urb *urb, gfp_t memoria)
+{
+	int retval;
+
+	urb->interval = dev->interval_programat;
+	usb_anchor_urb(urb, &dev->anchor_entrada);
+	retval = usb_submit_urb(urb, memoria);
+	if (retval) usb_unanchor_urb(urb);
+	return retval;
+}
+
+
+
+/**
+ *	bdu_enviar_entrades: envia tots els urbs de captacio de tecles (retorna el primer error)
+ */
+static int bdu_enviar_entrades(struct bdusb *dev, gfp_t memoria)
+{
+	int i, retval = 0;
+
+	for (i = 0; i < dev->num_entrades; i++)
+		if (!retval) retval = bdu_enviar_entrada(dev, dev->urbs_entrada[i], memoria);
+	return retval;
+}
+
+
+
+/**
+ *	bdu_ajustar_interval: tria l'interval de sondeig segons l'activitat del teclat i, si canvia, cancel·la
+ *		els urbs de captacio i els torna a enviar amb el nou interval (el controlador nomes el llegeix en enviar-los)
+ */
+static void bdu_ajustar_interval(struct work_struct *work)
+{
+	struct bdusb *dev = container_of(to_delayed_work(work), struct bdusb, t_interval);
+	unsigned long fi_activitat = dev->darrera_tecla + msecs_to_jiffies(INACTIVITAT_TECLAT_MS);
+	int interval = dev->interval_repos;
+
+	if (!dev->interface || dev->suspes) return;	// en despertar, els urbs ja s'envien amb 'interval_programat'
+	if (dev->interval_actiu && time_before(jiffies, fi_activitat))
+	{	/* s'estan prement tecles: es torna a mirar quan hagi passat l'estona d'inactivitat */
+		interval = dev->interval_actiu;
+		queue_delayed_work(dev->cua_treballs, &dev->t_interval, fi_activitat - jiffies);
+	}
+	if (interval == dev->interval_programat) return;
+
+	dev->interval_programat = interval;
+	dev->reprogramant = 1;
+	usb_kill_anchored_urbs(&dev->anchor_entrada);
+	dev->reprogramant = 0;
+	if (bdu_enviar_entrades(dev, GFP_KERNEL))
+		err(" -> ERROR: no s'han pogut reenviar els urbs de captacio de tecles\n");
+}
+
+
+
+/**
+ *	bdu_crear_teclat_entrada: registra el teclat del dispositiu com a dispositiu d'entrada del sistema
+ */
+static int bdu_crear_teclat_entrada(struct bdusb *dev)
+{
+	struct input_dev *teclat;
+	int i, retval;
+
+	teclat = input_allocate_device();
+	if (!teclat) return -ENOMEM;
+
+	usb_make_path(dev->udev, dev->cami_teclat, sizeof(dev->cami_teclat));
+	strlcat(dev->cami_teclat, "/input0", sizeof(dev->cami_teclat));
+	teclat->name = "Botodispusb teclat";
+	teclat->phys = dev->cami_teclat;
+	usb_to_input_id(dev->udev, &teclat->id);
+	teclat->dev.parent = &dev->interface->dev;
+
+	/* tecles amb el seu KEY_* i el codi ASCII original com a MSC_SCAN */
+	memcpy(dev->codis_tecla, bdu_codis_tecla_def, sizeof(dev->codis_tecla));
+	teclat->keycode = dev->codis_tecla;
+	teclat->keycodesize = sizeof(dev->codis_tecla[0]);
+	teclat->keycodemax = NUM_CODIS_TECLA;
+	__set_bit(EV_KEY, teclat->evbit);
+	__set_bit(EV_MSC, teclat->evbit);
+	__set_bit(MSC_SCAN, teclat->mscbit);
+	for (i = 0; i < NUM_CODIS_TECLA; i++)
+		__set_bit(dev->codis_tecla[i], teclat->keybit);
+	__clear_bit(KEY_RESERVED, teclat->keybit);
+	input_set_drvdata(teclat, dev);
+
+	retval = input_register_device(teclat);
+	if (retval)
+	{
+		input_free_device(teclat);
+		return retval;
+	}
+	dev->teclat = teclat;
+	return 0;
+}
+
+
+
+/**
+ *	bdu_informar_tecla: genera els events d'entrada d'una tecla (s'invoca des de 'bdu_in_callback')
+ *		El teclat nomes avisa quan es prem una tecla: la pulsacio i l'alliberament van junts.
+ */
+static void bdu_informar_tecla(struct bdusb *dev, unsigned char tecla)
+{
+	unsigned int codi;
+
+	if (!dev->teclat || (tecla >= NUM_CODIS_TECLA)) return;
+
+	codi = dev->codis_tecla[tecla];
+	input_event(dev->teclat, EV_MSC, MSC_SCAN, tecla);
+	if (codi != KEY_RESERVED)
+	{
+		input_report_key(dev->teclat, codi, 1);
+		input_sync(dev->teclat);
+		input_report_key(dev->teclat, codi, 0);
+	}
+	input_sync(dev->teclat);
+}
+
+
+/**
+ *	bdu_obtenir_sortida: treu una entrada lliure de l'anell de sortida
+ *		Es bloqueja mentre totes les entrades estiguin en curs; retorna NULL si s'interromp l'espera,
+ *		si el dispositiu s'ha desconnectat (o, amb 'no_bloquejar', si no n'hi ha cap de lliure).
+ */
+static struct bdu_sortida *bdu_obtenir_sortida(struct bdusb *dev, int no_bloquejar)
+{
+	struct bdu_sortida *sortida;
+	unsigned long flags;
+
+	if (no_bloquejar)
+	{
+		if (down_trylock(&dev->sem)) return NULL;
+	}
+	else if (down_trylock(&dev->sem))
+	{	/* l'anell es ple: apunta quant s'espera fins que se n'allibera una entrada */
+		ktime_t inici = ktime_get();
+		int interromput = down_interruptible(&dev->sem);
+
+		BDU_COMPTAR(dev, esperes_anell, 1);
+		BDU_COMPTAR(dev, espera_anell_us, ktime_to_us(ktime_sub(ktime_get(), inici)));
+		if (interromput) return NULL;
+	}
+	if (!dev->interface)
+	{	/* desconnectat mentre s'esperava: l'entrada no s'enviaria */
+		up(&dev->sem);
+		return NULL;
+	}
+
+	spin_lock_irqsave(&dev->lock_sortides, flags);
+	sortida = &dev->sortides[dev->primera_lliure];
+	dev->primera_lliure = sortida->seguent;
+	spin_unlock_irqrestore(&dev->lock_sortides, flags);
+	return sortida;
+}
+
+
+/**
+ *	bdu_enviar_sortida: envia pel bulk_out_endpoint els 'longitud' primers bytes del buffer de l'entrada
+ *		Si l'enviament falla, l'entrada es retorna a l'anell immediatament.
+ */
+static int bdu_enviar_sortida(struct bdusb *dev, struct bdu_sortida *sortida, int longitud)
+{
+	struct usb_interface *interface = dev->interface;
+	int retval;
+
+	/* el dispositiu ha d'estar despert mentre el paquet es en curs (la referencia es deixa al callback) */
+	retval = interface ? usb_autopm_get_interface(interface) : -ENODEV;
+	if (retval == 0)
+	{
+		sortida->urb->transfer_buffer_length = longitud;	// la resta de l'urb es va preparar a 'bdu_crear_sortides'
+		usb_anchor_urb(sortida->urb, &dev->anchor_sortida);
+		retval = usb_submit_urb(sortida->urb, GFP_ATOMIC);
+		if (retval)
+		{
+			usb_unanchor_urb(sortida->urb);
+			usb_autopm_put_interface_async(interface);
+		}
+	}
+	trace_bdu_enviament(dev->minor, sortida - dev->sortides, sortida->buffer[0], longitud, retval);
+	if (retval)
+	{
+		BDU_COMPTAR(dev, urbs_no_enviats, 1);
+		bdu_alliberar_sortida(dev, sortida);
+	}
+	else BDU_COMPTAR(dev, urbs_enviats, 1);
+	return retval;
+}
+
+
+/**
+ *	bdu_alliberar_sortida: retorna una entrada a l'anell de sortida (es pot cridar des del callback)
+ */
+static void bdu_alliberar_sortida(struct bdusb *dev, struct bdu_sortida *sortida)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock_sortides, flags);
+	sortida->seguent = dev->primera_lliure;
+	dev->primera_lliure = sortida - dev->sortides;
+	spin_unlock_irqrestore(&dev->lock_sortides, flags);
+	up(&dev->sem);
+
+	/* avisa els escriptors que esperen lloc (poll) i continua l'enviament que hagi quedat a mitges */
+	wake_up_interruptible(&dev->cua_escriptura);
+	if (dev->enviament_pendent && dev->interface) queue_work(dev->cua_treballs, &dev->t_buidar);
+}
+
+
+/**
+ *	bdu_hi_ha_sortida_lliure: indica si hi ha alguna entrada lliure a l'anell de sortida
+ */
+static int bdu_hi_ha_sortida_lliure(struct bdusb *dev)
+{
+	return ACCESS_ONCE(dev->primera_lliure) >= 0;
+}
+
+
+/**
+ *	bdu_sortides_lliures: compta les entrades lliures de l'anell de sortida
+ */
+static int bdu_sortides_lliures(struct bdusb *dev)
+{
+	unsigned long flags;
+	int i, n = 0;
+
+	spin_lock_irqsave(&dev->lock_sortides, flags);
+	for (i = dev->primera_lliure; i >= 0; i = dev->sortides[i].seguent)
+		n++;
+	spin_unlock_irqrestore(&dev->lock_sortides, flags);
+	return n;
+}
+
+
+/**
+ *	bdu_lot_iniciar: prepara un lot de paquets per a l'anell de sortida, sense cap paquet en construccio
+ *		El codificador segueix el cursor del display a 'col_display'.
+ */
+static void bdu_lot_iniciar(struct bdusb *dev, struct bdu_lot *lot, int no_bloquejar)
+{
+	lot->dev = dev;
+	lot->sortida = NULL;
+	lot->no_bloquejar = no_bloquejar;
+	bdu_cod_iniciar(&lot->cod, dev->bulk_out_size, dev->columnes, &dev->col_display,
+			bdu_lot_obtenir, bdu_lot_enviar, lot);
+}
+
+
+/**
+ *	bdu_lot_obtenir: obte una entrada de l'anell de sortida per al proper paquet del lot
+ *		(funcio 'obtenir' del codificador)
+ */
+static int bdu_lot_obtenir(void *context, unsigned char **paquet)
+{
+	struct bdu_lot *lot = context;
+	struct bdusb *dev = lot->dev;
+
+	lot->sortida = bdu_obtenir_sortida(dev, lot->no_bloquejar);
+	if (lot->sortida == NULL)
+	{
+		if (!dev->interface) return -ENODEV;
+		return lot->no_bloquejar ? -EAGAIN : -ERESTARTSYS;
+	}
+	lot->sortida->t_tecla = ktime_set(0, 0);
+	*paquet = lot->sortida->buffer;
+	return 0;
+}
+
+
+/**
+ *	bdu_lot_enviar: envia el paquet acabat del lot (funcio 'enviar' del codificador)
+ */
+static int bdu_lot_enviar(void *context, int longitud)
+{
+	struct bdu_lot *lot = context;
+	int retval;
+
+	retval = bdu_enviar_sortida(lot->dev, lot->sortida, longitud);
+	lot->sortida = NULL;
+	return retval;
+}
+
+
+/**
+ *	bdu_escriure_celles: copia a 'desitjat' els bytes de l'aplicacio a partir de la cel·la 'pos'
+ *		(s'invoca amb 'mutex_pantalla' agafat). En arribar al final d'una fila es continua a la seguent,
+ *		un '\n' salta a l'inici de la fila seguent i, passada l'ultima fila, el display es desplaça
+ *		una fila cap amunt. Deixa el cursor logic darrere l'ultim caracter i retorna els bytes acceptats.
+ */
+static ssize_t bdu_escriure_celles(struct bdusb *dev, loff_t pos, const char *user_buffer, size_t count)
+{
+	struct bdu_escriptura e = { pos, 0, 0 };
+	unsigned char bloc[64];
+	size_t fets, n;
+	int retval;
+
+	if ((pos < 0) || (pos > dev->celles)) return -EINVAL;
+	/* l'estat de l'escapada no passa d'una escriptura a la seguent: l'id del glif hi ha de ser */
+	retval = bdu_acaba_en_escapada(user_buffer, count);
+	if (retval) return (retval < 0) ? retval : -EINVAL;
+
+	for (fets = 0; fets < count; fets += n)
+	{
+		/* captura un bloc de caracters de l'aplicacio */
+		n = min_t(size_t, count - fets, sizeof(bloc));
+		if (copy_from_user(bloc, &user_buffer[fets], n))
+		{
+			dev->cursor = e.cella;
+			return fets ? fets : -EFAULT;
+		}
+
+		bdu_escriure_bloc(dev, &e, bloc, n);
+	}
+	dev->cursor = e.cella;			// apuntem el desplaçament automatic del cursor
+	return count;
+}
+
+
+/**
+ *	bdu_escriure_bloc: copia a 'desitjat' un bloc de caracters ja a memoria del nucli a partir de 'e->cella'
+ *		(veure 'bdu_escriure_celles'; l'estat 'e' es conserva d'un bloc al seguent). BDU_ESCAPADA_GLIF
+ *		seguit d'un id es substitueix pel codi de la ranura de la CGRAM on es carrega el glif.
+ */
+static void bdu_escriure_bloc(struct bdusb *dev, struct bdu_escriptura *e, const unsigned char *bloc, size_t n)
+{
+	unsigned char c;
+	size_t k;
+
+	for (k = 0; k < n; k++)
+	{
+		c = bloc[k];
+		if (e->escapada)
+		{
+			e->escapada = 0;
+			c = bdu_codi_glif(dev, c);
+		}
+		else if (c == BDU_ESCAPADA_GLIF)
+		{
+			e->escapada = 1;
+			continue;
+		}
+		else if (c == '\n')
+		{	/* si el caracter anterior ja ha omplert la fila, el salt ja s'ha fet */
+			if (!e->fila_plena)
+			{
+				if (e->cella == dev->celles)
+				{
+					bdu_desplacar_amunt(dev);
+					e->cella -= dev->columnes;
+				}
+				e->cella = (e->cella / dev->columnes + 1) * dev->columnes;
+			}
+			e->fila_plena = 0;
+			continue;
+		}
+		if (e->cella == dev->celles)
+		{	/* passada l'ultima cel·la: desplaça el display i continua a l'ultima fila */
+			bdu_desplacar_amunt(dev);
+			e->cella -= dev->columnes;
+		}
+		dev->desitjat[e->cella] = c;
+		bdu_marcar_brut(dev, e->cella, e->cella + 1);
+		e->cella++;
+		e->fila_plena = ((e->cella % dev->columnes) == 0);
+	}
+}
+
+
+/**
+ *	bdu_escapades_finals: nombre de BDU_ESCAPADA_GLIF seguits al final d'un bloc
+ *		Si son senars, l'ultim no te id de glif (els anteriors fan d'escapada i d'id alternativament).
+ */
+static size_t bdu_escapades_finals(const unsigned char *bloc, size_t n)
+{
+	size_t k = n;
+
+	while ((k > 0) && (bloc[k - 1] == BDU_ESCAPADA_GLIF))
+		k--;
+	return n - k;
+}
+
+
+/**
+ *	bdu_acaba_en_escapada: indica si un text de l'aplicacio acaba amb un BDU_ESCAPADA_GLIF sense id de glif
+ *		Nomes llegeix el final del text, de darrere cap endavant, fins al primer byte que no es una escapada.
+ */
+static int bdu_acaba_en_escapada(const char *user_buffer, size_t count)
+{
+	unsigned char bloc[16];
+	size_t n, k, seguides = 0;
+
+	while (count > 0)
+	{
+		n = min_t(size_t, count, sizeof(bloc));
+		if (copy_from_user(bloc, &user_buffer[count - n], n)) return -EFAULT;
+		k = bdu_escapades_finals(bloc, n);
+		seguides += k;
+		if (k < n) break;
+		count -= n;
+	}
+	return seguides & 1;
+}
+
+
+/**
+ *	bdu_codi_glif: codi de caracter amb que es mostra el glif 'id' (amb 'mutex_pantalla' agafat)
+ *		Si el glif no es a cap ranura de la CGRAM, se li assigna la que fa mes temps que no s'usa d'entre
+ *		les que no es veuen al display (ni a 'desitjat' ni a 'pantalla'), i queda pendent d'enviar-lo.
+ */
+static unsigned char bdu_codi_glif(struct bdusb *dev, unsigned int id)
+{
+	int r, tria = -1;
+
+	if ((id >= BDU_GLIFS_MAX) || !test_bit(id, dev->glifs_definits)) return GLIF_NO_DISPONIBLE;
+
+	for (r = 0; r < NUM_RANURES_CGRAM; r++)
+	{
+		if (dev->ranura_glif[r] == id)
+		{	/* ja hi es carregat */
+			dev->us_ranura[r] = ++dev->rellotge_glifs;
+			return r;
+		}
+		if (memchr(dev->desitjat, r, dev->celles) || memchr(dev->pantalla, r, dev->celles))
+			continue;	// la ranura es veu al display: no es pot reemplaçar
+		if ((tria < 0) || (dev->us_ranura[r] < dev->us_ranura[tria]))
+			tria = r;	// les ranures lliures no s'han usat mai (instant 0)
+	}
+	if (tria < 0) return GLIF_NO_DISPONIBLE;
+
+	dev->ranura_glif[tria] = id;
+	dev->us_ranura[tria] = ++dev->rellotge_glifs;
+	dev->ranures_pendents |= 1 << tria;
+	return tria;
+}
+
+
+/**
+ *	bdu_definir_glif: guarda el mapa de punts d'un glif (BDU_IOC_GLIF); si ja es al display, el torna a enviar
+ */
+static long bdu_definir_glif(struct bdusb *dev, const struct bdu_glif *g)
+{
+	int r, retval = 0;
+
+	if (g->id >= BDU_GLIFS_MAX) return -EINVAL;
+	if (mutex_lock_interruptible(&dev->mutex_pantalla)) return -ERESTARTSYS;
+
+	memcpy(dev->glifs[g->id], g->mapa, BYTES_GLIF);
+	set_bit(g->id, dev->glifs_definits);
+	for (r = 0; r < NUM_RANURES_CGRAM; r++)
+	{
+		if (dev->ranura_glif[r] != g->id) continue;
+		dev->ranures_pendents |= 1 << r;
+		retval = bdu_sincronitzar(dev, SINC_CURSOR);
+	}
+	mutex_unlock(&dev->mutex_pantalla);
+	return retval;
+}
+
+
+/**
+ *	bdu_desplacar_amunt: desplaça el contingut desitjat del display una fila cap amunt i buida l'ultima
+ */
+static void bdu_desplacar_amunt(struct bdusb *dev)
+{
+	memmove(dev->desitjat, &dev->desitjat[dev->columnes], dev->celles - dev->columnes);
+	memset(&dev->desitjat[dev->celles - dev->columnes], ' ', dev->columnes);
+	bdu_marcar_brut(dev, 0, dev->celles);
+}
+
+
+/**
+ *	bdu_canviar_geometria: estableix les files i columnes del display (amb 'mutex_pantalla' agafat)
+ *		El contingut desitjat queda en blanc, el cursor a l'inici i el display s'esborrara al seguent enviament.
+ */
+static int bdu_canviar_geometria(struct bdusb *dev, int files, int columnes)
+{
+	if ((files < 1) || (files > NUM_FILES_MAX) || (columnes < 1) || (columnes > NUM_COLUMNES_MAX))
+		return -EINVAL;
+	if ((files > 2) && (2 * columnes > NUM_COLUMNES_MAX))	// les files 2 i 3 comparteixen memoria amb les 0 i 1
+		return -EINVAL;
+
+	bdu_aturar_animacions(dev);		// les animacions eren per a l'altra geometria
+	dev->files = files;
+	dev->columnes = columnes;
+	dev->celles = files * columnes;
+	dev->cursor = 0;
+	memset(dev->desitjat, ' ', MAX_CELLES);
+	dev->pantalla_valida = 0;
+	dev->col_display = -1;
+	bdu_marcar_brut(dev, 0, dev->celles);
+	return 0;
+}
+
+
+/**
+ *	bdu_marcar_brut: apunta que les cel·les [inici, fi) de 'desitjat' s'han de comparar amb el display
+ */
+static void bdu_marcar_brut(struct bdusb *dev, int inici, int fi)
+{
+	if (inici >= fi) return;
+	if (inici < dev->brut_inici) dev->brut_inici = inici;
+	if (fi > dev->brut_fi) dev->brut_fi = fi;
+}
+
+
+/**
+ *	bdu_sincronitzar: envia al display el minim de comandes i dades per passar de 'pantalla' a 'desitjat'
+ *		(s'invoca amb 'mutex_pantalla' agafat)
+ *
+ *		Cada tram de cel·les canviades costa una comanda de cursor (si el cursor del display no hi es ja)
+ *		i les seves dades. Dos trams de la mateixa fila separats per menys cel·les de les que caben en un
+ *		paquet s'envien com un de sol, perque reenviar les cel·les iguals surt mes barat que dos paquets mes.
+ *		Amb SINC_CURSOR, al final es deixa el cursor del display a la posicio logica 'cursor'.
+ *		Amb SINC_NO_BLOQUEJAR, si s'acaben les entrades de l'anell es retorna -EAGAIN i la resta dels
+ *		canvis queda pendent: s'enviara des de 'bdu_buidar' quan el dispositiu alliberi una entrada.
+ *		Si falla un enviament, es dona la copia per invalida i el seguent cop es redibuixa tot.
+ *		'desitjat' pot estar projectat a l'aplicacio, que el pot modificar en qualsevol moment.
+ */
+static int bdu_sincronitzar(struct bdusb *dev, int opcions)
+{
+	struct bdu_lot lot;
+	int retval;
+
+	bdu_lot_iniciar(dev, &lot, opcions & SINC_NO_BLOQUEJAR);
+	retval = bdu_afegir_canvis(dev, &lot, opcions);
+	if (retval == 0)
+	{
+		if (lot.sortida) lot.sortida->t_tecla = dev->t_eco;	// l'ultim paquet tanca l'eco de les tecles
+		retval = bdu_cod_enviar(&lot.cod);
+	}
+	return bdu_acabar_sincronitzacio(dev, retval);
+}
+
+
+/**
+ *	bdu_afegir_canvis: afegeix al paquet en construccio les comandes i dades que passen de 'pantalla' a
+ *		'desitjat' (veure 'bdu_sincronitzar'). No envia l'ultim paquet, que encara es pot continuar omplint.
+ *		Si retorna un error, el paquet ja no esta en construccio.
+ */
+static int bdu_afegir_canvis(struct bdusb *dev, struct bdu_lot *lot, int opcions)
+{
+	int i, j, fi, fi_fila, forat_max, retval = 0;
+
+	if (!dev->pantalla_valida)
+	{	/* estat desconegut: esborra el display i compara amb una pantalla en blanc */
+		retval = bdu_cod_afegir(&lot->cod, TIPUS_COMANDA, COMANDA_NETEJAR);
+		if (retval) return retval;
+		memset(dev->pantalla, ' ', MAX_CELLES);
+		dev->col_display = 0;
+		dev->pantalla_valida = 1;
+		bdu_marcar_brut(dev, 0, dev->celles);
+	}
+	/* primer els glifs que encara no son a la CGRAM, perque les cel·les que els mostren ja es vegin be */
+	for (i = 0; i < NUM_RANURES_CGRAM; i++)
+	{
+		if (!(dev->ranures_pendents & (1 << i))) continue;
+		retval = bdu_cod_afegir(&lot->cod, TIPUS_COMANDA, COMANDA_CGRAM + i * BYTES_GLIF);
+		if (retval) return retval;
+		dev->col_display = -1;		// el display ara escriu a la CGRAM: cal tornar a posar el cursor
+		retval = bdu_cod_afegir_bytes(&lot->cod, TIPUS_DADES, dev->glifs[dev->ranura_glif[i]], BYTES_GLIF, NULL);
+		if (retval) return retval;
+		dev->ranures_pendents &= ~(1 << i);
+	}
+	if (dev->brut_fi > dev->celles) dev->brut_fi = dev->celles;
+
+	forat_max = dev->bulk_out_size - 1;
+	i = dev->brut_inici;
+	while (i < dev->brut_fi)
+	{
+		if (ACCESS_ONCE(dev->desitjat[i]) == dev->pantalla[i])
+		{
+			i++;
+			continue;
+		}
+		/* inici d'un tram: l'allarguem dins la fila mentre les cel·les iguals entremig siguin poques */
+		fi = i + 1;
+		fi_fila = min(dev->brut_fi, (i / dev->columnes + 1) * dev->columnes);
+		for (j = fi; (j < fi_fila) && (j - fi < forat_max); j++)
+			if (ACCESS_ONCE(dev->desitjat[j]) != dev->pantalla[j]) fi = j + 1;
+
+		/* l'aplicacio pot modificar 'desitjat' mentrestant (mmap): es llegeix un sol cop, i a 'pantalla'
+		   hi va el que s'ha posat al paquet. El codificador mou 'col_display' */
+		retval = bdu_cod_tram(&lot->cod, i, &dev->desitjat[i], fi - i, &dev->pantalla[i]);
+		if (retval) return retval;
+		i = fi;
+	}
+
+	if ((opcions & SINC_CURSOR) && (dev->cursor < dev->celles))
+	{
+		retval = bdu_cod_cursor(&lot->cod, dev->cursor);
+		if (retval) return retval;
+	}
+	dev->brut_inici = MAX_CELLES;
+	dev->brut_fi = 0;
+	return 0;
+}
+
+
+/**
+ *	bdu_acabar_sincronitzacio: tracta el resultat d'enviar els canvis del display
+ *		Si falla un enviament, es dona la copia per invalida i el seguent cop es redibuixa tot.
+ */
+static int bdu_acabar_sincronitzacio(struct bdusb *dev, int retval)
+{
+	int i;
+
+	if (retval == 0)
+	{
+		dev->enviament_pendent = 0;
+		return 0;
+	}
+	if (retval == -EAGAIN)
+	{	/* el que ja es a l'anell s'enviara; la resta queda marcada per a 'bdu_buidar' */
+		dev->col_display = -1;
+		dev->enviament_pendent = 1;
+		if (bdu_hi_ha_sortida_lliure(dev) && dev->interface) queue_work(dev->cua_treballs, &dev->t_buidar);
+		return retval;
+	}
+	dev->pantalla_valida = 0;
+	dev->col_display = -1;
+	bdu_marcar_brut(dev, 0, dev->celles);
+	for (i = 0; i < NUM_RANURES_CGRAM; i++)	// tampoc se sap si els glifs hi han arribat
+		if (dev->ranura_glif[i] >= 0) dev->ranures_pendents |= 1 << i;
+	return retval;
+}
+
+
+
+/**
+ *	bdu_programar_recuperacio: programa la recuperacio despres d'un paquet perdut (s'invoca des de 'bdu_out_callback')
+ *		L'espera es dobla a cada intent seguit sense exit; esgotats els intents, l'error queda per a l'escriptor.
+ */
+static void bdu_programar_recuperacio(struct bdusb *dev)
+{
+	int intents = dev->intents_recuperacio;
+
+	if (!dev->interface) return;
+	if (intents >= INTENTS_RECUPERACIO)
+	{
+		dev->error_sortida = dev->endpoint_aturat ? -EPIPE : -EIO;
+		return;
+	}
+	queue_delayed_work(dev->cua_treballs, &dev->t_recuperar,
+		msecs_to_jiffies(min(RECUPERACIO_MIN_MS << intents, RECUPERACIO_MAX_MS)));
+}
+
+
+
+/**
+ *	bdu_recuperar: desbloqueja l'endpoint si cal i torna a enviar tot el display (treball de 't_recuperar')
+ */
+static void bdu_recuperar(struct work_struct *work)
+{
+	struct bdusb *dev = container_of(work, struct bdusb, t_recuperar.work);
+	int retval = 0;
+
+	if (!dev->interface) return;
+	dev->intents_recuperacio++;
+
+	/* amb 'mutex_pantalla' ningu no envia res mentrestant. Els urbs que encara son a la cua de l'endpoint
+	   s'han de cancel·lar abans de desbloquejar-lo ('usb_clear_halt'); de tota manera, s'enviara tot de nou */
+	mutex_lock(&dev->mutex_pantalla);
+	dev->cancelant_sortides = 1;
+	usb_kill_anchored_urbs(&dev->anchor_sortida);
+	dev->cancelant_sortides = 0;
+	if (dev->endpoint_aturat)
+	{
+		retval = usb_clear_halt(dev->udev, usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr));
+		if (retval == 0) dev->endpoint_aturat = 0;
+	}
+
+	/* no se sap que ha arribat al display: s'invalida la copia i s'envia tot de nou */
+	if (retval == 0)
+	{
+		bdu_acabar_sincronitzacio(dev, -EIO);
+		retval = bdu_sincronitzar(dev, SINC_CURSOR | SINC_NO_BLOQUEJAR);
+		if (retval == -EAGAIN) retval = 0;	// la resta l'enviara 'bdu_buidar' quan hi hagi lloc
+	}
+	mutex_unlock(&dev->mutex_pantalla);
+
+	if (retval == 0)
+		BDU_COMPTAR(dev, recuperacions, 1);
+	else if (dev->intents_recuperacio < INTENTS_RECUPERACIO)
+		queue_delayed_work(dev->cua_treballs, &dev->t_recuperar,
+			msecs_to_jiffies(min(RECUPERACIO_MIN_MS << dev->intents_recuperacio, RECUPERACIO_MAX_MS)));
+	else
+	{
+		printk(KERN_INFO "BDUSB: no s'ha pogut recuperar el display (%d)\n", retval);
+		dev->error_sortida = retval;
 	}
 }
 
@@ -598,6 +3085,13 @@ void Processar_tecla(struct work_struct *work)
 module_init(bdu_init);
 module_exit(bdu_exit);
 module_param(num_files, int, S_IRUGO);
+module_param(num_columnes, int, S_IRUGO);
+module_param(coalescencia_us, int, S_IRUGO);
+module_param(num_urbs_sortida, int, S_IRUGO);
+module_param(num_urbs_entrada, int, S_IRUGO);
+module_param(interval_teclat, int, S_IRUGO);
+module_param(interval_teclat_actiu, int, S_IRUGO);
+module_param(minor_base, int, S_IRUGO);
 /**	
  *	INFORMACIO sobre el modul
  */
@@ -0,0 +1,150 @@
+/**
+ *	Botodispusb driver : definicions compartides amb les aplicacions
+ *
+ *	Descripcio :
+ *		-> comandes 'ioctl' que accepta el dispositiu '/dev/bd_usbN' (cal haver-lo obert per escriure)
+ *		-> el dispositiu el poden obrir diverses aplicacions: totes reben totes les tecles amb 'read'
+ *		   (des que l'han obert) i totes hi poden escriure, excepte si s'obre per escriure amb O_EXCL:
+ *		   llavors es l'unic escriptor (les altres obertures per escriure i BDU_IOC_DIFONDRE reben -EBUSY)
+ *		-> escriptura d'un mateix text a molts displays amb una sola crida (BDU_IOC_DIFONDRE)
+ *		-> lots d'operacions (cursor, text, esborrat, comandes) en una sola crida (BDU_IOC_OPERACIONS)
+ *		-> text desplaçant-se (marquesina) i parpelleig d'una fila generats pel driver (BDU_IOC_ANIMAR)
+ *		-> glifs propis (icones, caracters no ASCII) identificats per un numero (BDU_IOC_GLIF)
+ *		-> accio que fa el driver amb cada tecla premuda (BDU_IOC_ACCIONS)
+ *		-> el contingut del display es pot projectar a memoria amb 'mmap' (una cel·la per byte,
+ *		   fila per fila) i enviar els canvis amb BDU_IOC_REFRESCAR o amb 'msync(MS_SYNC)'
+ */
+#ifndef BOTODISPUSB_H
+#define BOTODISPUSB_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define BDU_IOC_MAGIC		'B'
+
+/* envia al display els canvis fets a la projeccio a memoria (nomes les cel·les que han canviat)
+   i les escriptures que esperaven a ajuntar-se (coalescencia) */
+#define BDU_IOC_REFRESCAR	_IO(BDU_IOC_MAGIC, 0)
+
+/* escriu el mateix text a diversos displays amb una sola crida (es pot fer des de qualsevol
+   '/dev/bd_usbN' obert per escriure). Els displays s'indiquen amb descriptors de '/dev/bd_usbN' que
+   l'aplicacio ja te oberts per escriure (-EBADF si no ho estan), de manera que nomes s'hi pot escriure
+   si els permisos de cada node ho permeten. Els enviaments de tots els displays queden en curs alhora:
+   no s'espera cap display per passar al seguent. Retorna el numero de displays actualitzats */
+#define BDU_DIFUSIO_MAX_TEXT	256	/* bytes maxims del text */
+#define BDU_DIFUSIO_MAX_DISP	256	/* displays maxims per crida */
+
+struct bdu_difusio
+{
+	__u64	text;		/* adreça del text (es tracta com 'write': '\n' salta de fila) */
+	__u32	longitud;	/* bytes del text */
+	__s32	posicio;	/* cel·la on comença el text (-1: posicio actual del cursor de cada display) */
+	__u64	fds;		/* adreça d'un vector de 'num_fds' __s32 amb els descriptors dels displays */
+	__u32	num_fds;
+	__u32	reservat;
+	__u64	resultats;	/* adreça d'un vector de 'num_fds' __s32 on es deixa el resultat de
+				   cada display (0 o -errno); pot ser 0 si no interessa */
+};
+
+#define BDU_IOC_DIFONDRE	_IOW(BDU_IOC_MAGIC, 1, struct bdu_difusio)
+
+/* executa en ordre un vector d'operacions sobre el display i n'envia el resultat amb el minim de
+   paquets: les operacions de cursor, text i esborrat nomes canvien la copia del display, i al final
+   s'envien les cel·les que han canviat (com 'write' seguit de BDU_IOC_REFRESCAR). Retorna el nombre
+   d'operacions fetes. Amb O_NONBLOCK no s'espera lloc per als paquets: les cel·les ja canviades
+   s'acaben d'enviar soles, pero una BDU_OP_COMANDA que no hi cap no s'executa i es retornen les
+   operacions fetes fins aleshores (-EAGAIN si cap). Una BDU_OP_COMANDA que necessita mes paquets
+   dels que te l'anell de sortida no s'enviaria mai sencera: amb O_NONBLOCK falla amb -EINVAL */
+#define BDU_OP_CURSOR		0	/* posa el cursor a la cel·la 'valor' (0 .. files * columnes) */
+#define BDU_OP_TEXT		1	/* escriu 'longitud' bytes de 'dades' a partir del cursor (com 'write') */
+#define BDU_OP_NETEJAR		2	/* esborra el display i posa el cursor a la cel·la 0 */
+#define BDU_OP_COMANDA		3	/* envia 'longitud' bytes de 'dades' tal qual com a comandes del display.
+					   El driver no sap que fan: despres no suposa res de la posicio del cursor,
+					   pero si canvien el contingut del display cal fer BDU_IOC_REFRESCAR */
+#define BDU_OPERACIONS_MAX	256	/* operacions maximes per crida */
+#define BDU_OPERACIO_MAX_DADES	256	/* bytes maxims de 'dades' d'una operacio (-EINVAL si n'hi ha mes) */
+
+struct bdu_operacio
+{
+	__u32	tipus;		/* BDU_OP_... */
+	__u32	valor;		/* cel·la de BDU_OP_CURSOR */
+	__u32	longitud;	/* bytes de 'dades' de BDU_OP_TEXT i BDU_OP_COMANDA */
+	__u32	reservat;
+	__u64	dades;		/* adreça dels bytes de BDU_OP_TEXT i BDU_OP_COMANDA */
+};
+
+struct bdu_operacions
+{
+	__u64	operacions;	/* adreça d'un vector de 'num_operacions' struct bdu_operacio */
+	__u32	num_operacions;
+	__u32	reservat;
+};
+
+#define BDU_IOC_OPERACIONS	_IOW(BDU_IOC_MAGIC, 2, struct bdu_operacions)
+
+/* carrega un text per a una fila que el driver va desplaçant (de manera circular) cada 'pas_ms'
+   mil·lisegons i/o fent parpellejar cada 'parpelleig_ms' mil·lisegons, sense que l'aplicacio hagi
+   d'intervenir. Amb 'longitud' 0 s'atura l'animacio de la fila (que conserva l'ultim contingut).
+   Mentre dura, l'animacio sobreescriu el que s'escrigui a la fila */
+#define BDU_ANIMACIO_MAX_TEXT	256	/* bytes maxims del text */
+#define BDU_ANIMACIO_MIN_MS	20	/* periode minim de desplaçament i parpelleig */
+
+struct bdu_animacio
+{
+	__u64	text;		/* adreça del text */
+	__u32	longitud;	/* bytes del text (0 atura l'animacio) */
+	__u32	fila;		/* fila del display (0 .. files - 1) */
+	__u32	pas_ms;		/* periode de desplaçament (0 sense desplaçament) */
+	__s32	direccio;	/* 1: el text avança cap a l'esquerra, -1: cap a la dreta */
+	__u32	parpelleig_ms;	/* mig periode de parpelleig (0 sense parpelleig) */
+	__u32	reservat;
+};
+
+#define BDU_IOC_ANIMAR		_IOW(BDU_IOC_MAGIC, 3, struct bdu_animacio)
+
+/* defineix (o redefineix) el glif 'id' amb un mapa de 5x8 punts (bits 4..0 de cada fila, de dalt a
+   baix). Per mostrar-lo, s'escriu el byte BDU_ESCAPADA_GLIF seguit de l'id amb 'write' o en els
+   textos de BDU_IOC_OPERACIONS i BDU_IOC_DIFONDRE (BDU_IOC_ANIMAR copia el text tal qual).
+   L'escapada i l'id han d'anar en la mateixa escriptura (o segment de 'writev', text o macro):
+   un text que acaba amb un BDU_ESCAPADA_GLIF sense id es rebutja sencer amb -EINVAL.
+   El display nomes te 8 glifs a la vegada: el driver hi carrega els que calen, reemplaçant el
+   que fa mes temps que no s'ha fet servir i que no es veu; si tots es veuen, es mostra un '?' */
+#define BDU_GLIFS_MAX		64	/* ids de glif valids: 0 .. BDU_GLIFS_MAX - 1 */
+#define BDU_ESCAPADA_GLIF	0x1b	/* byte que indica que el seguent es un id de glif */
+
+struct bdu_glif
+{
+	__u32	id;
+	__u8	mapa[8];
+};
+
+#define BDU_IOC_GLIF		_IOW(BDU_IOC_MAGIC, 4, struct bdu_glif)
+
+/* carrega la taula que diu que fa el driver al display amb cada tecla (codi ASCII 0 .. 127), sense
+   esperar l'aplicacio. Totes les tecles arriben igualment a 'read' i al dispositiu d'entrada.
+   Inicialment totes fan BDU_ACCIO_ECO, excepte la 'F', que fa BDU_ACCIO_ESBORRAR */
+#define BDU_ACCIO_ECO		0	/* mostra la tecla al cursor i l'avança */
+#define BDU_ACCIO_ESBORRAR	1	/* esborra el caracter anterior al cursor */
+#define BDU_ACCIO_NETEJAR	2	/* esborra el display i posa el cursor a l'inici */
+#define BDU_ACCIO_CURSOR	3	/* mou el cursor 'parametre' cel·les (negatiu: enrere) */
+#define BDU_ACCIO_NOMES_LECTOR	4	/* no fa res al display */
+#define BDU_ACCIO_MACRO		5	/* escriu els 'longitud' bytes de 'macro' al cursor (com 'write') */
+#define BDU_MACRO_MAX		16
+#define BDU_NUM_TECLES		128
+
+struct bdu_accio_tecla
+{
+	__u8	accio;		/* BDU_ACCIO_... */
+	__u8	longitud;	/* bytes de 'macro' */
+	__s16	parametre;	/* cel·les de BDU_ACCIO_CURSOR */
+	__u8	macro[BDU_MACRO_MAX];
+};
+
+struct bdu_accions
+{
+	struct bdu_accio_tecla	tecles[BDU_NUM_TECLES];
+};
+
+#define BDU_IOC_ACCIONS		_IOW(BDU_IOC_MAGIC, 5, struct bdu_accions)
+
+#endif /* BOTODISPUSB_H */
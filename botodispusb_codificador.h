@@ -0,0 +1,239 @@
+/**
+ *	Botodispusb codificador : empaquetament de les comandes i dades del display
+ *
+ *	Descripcio :
+ *		-> cada paquet cap al display comença amb el tipus (0x00 comandes HD44780, 0x01 dades) i
+ *		   porta bytes d'un sol tipus, fins a la mida maxima del bulk_out_endpoint
+ *		-> el codificador omple els buffers de paquet que li dona qui l'usa (no reserva memoria): quan
+ *		   un paquet es ple o canvia el tipus, l'envia i en demana un altre amb les funcions 'obtenir' i
+ *		   'enviar' que li han passat; els trams de bytes es copien de cop
+ *		-> trams de cel·les: comanda de cursor (nomes si el display no hi es ja) i les dades, seguint on
+ *		   deixa el cursor el display
+ *		-> adreça de la memoria del display (DDRAM) de cada cel·la segons el numero de columnes
+ *		-> no depen del nucli: el fan servir el driver i les eines d'espai d'usuari (eines/)
+ */
+#ifndef BOTODISPUSB_CODIFICADOR_H
+#define BOTODISPUSB_CODIFICADOR_H
+
+#ifdef __KERNEL__
+#include <linux/string.h>	/* memcpy */
+#else
+#include <string.h>
+#endif
+
+#define TIPUS_COMANDA		0x00	/* primer byte d'un paquet de comandes */
+#define TIPUS_DADES		0x01	/* primer byte d'un paquet de dades */
+#define COMANDA_NETEJAR		0x01	/* comanda d'esborrat del display (cursor a l'inici) */
+#define COMANDA_CURSOR		0x80	/* comanda de posicionament del cursor (+ adreca) */
+#define COMANDA_CGRAM		0x40	/* comanda d'adreçament de la memoria de glifs (+ ranura * 8) */
+#define ADRECA_FILA_SENAR	0x40	/* adreça de la primera cel·la de les files 1 i 3 */
+
+/**
+ *	Paquet en construccio (amb 'paquet' NULL no n'hi ha cap) i com obtenir-ne i enviar-ne
+ */
+struct bdu_codificador
+{
+	unsigned char*	paquet;		// buffer del paquet (el proporciona qui usa el codificador)
+	int		longitud;	// bytes ocupats del buffer (inclos el tipus)
+	int		mida;		// mida maxima del paquet (wMaxPacketSize)
+	int		columnes;	// columnes del display (adreces del cursor)
+	int*		cursor;		// cel·la on el display escriura la proxima dada (-1 si no se sap); la
+					// guarda qui usa el codificador, perque dura mes que els paquets
+	int		(*obtenir)(void *context, unsigned char **paquet);	// buffer per al proper paquet
+	int		(*enviar)(void *context, int longitud);		// envia el paquet acabat
+	void*		context;
+};
+
+
+/**
+ *	bdu_cod_iniciar: prepara el codificador, sense cap paquet en construccio
+ *		'obtenir' i 'enviar' retornen 0 o un error, que es retorna a qui ha afegit els bytes.
+ */
+static inline void bdu_cod_iniciar(struct bdu_codificador *cod, int mida, int columnes, int *cursor,
+				   int (*obtenir)(void *, unsigned char **), int (*enviar)(void *, int), void *context)
+{
+	cod->paquet = NULL;
+	cod->longitud = 0;
+	cod->mida = mida;
+	cod->columnes = columnes;
+	cod->cursor = cursor;
+	cod->obtenir = obtenir;
+	cod->enviar = enviar;
+	cod->context = context;
+}
+
+
+/**
+ *	bdu_cod_espai: bytes de 'tipus' que encara caben al paquet en construccio
+ *		0 vol dir que cal enviar el paquet (si n'hi ha) i començar-ne un altre.
+ */
+static inline int bdu_cod_espai(const struct bdu_codificador *cod, unsigned char tipus)
+{
+	if ((cod->paquet == NULL) || (cod->paquet[0] != tipus)) return 0;
+	return cod->mida - cod->longitud;
+}
+
+
+/**
+ *	bdu_cod_comencar: comença un paquet de 'tipus' al buffer 'paquet' de 'mida' bytes
+ */
+static inline void bdu_cod_comencar(struct bdu_codificador *cod, unsigned char *paquet, int mida, unsigned char tipus)
+{
+	cod->paquet = paquet;
+	cod->mida = mida;
+	cod->paquet[0] = tipus;
+	cod->longitud = 1;
+}
+
+
+/**
+ *	bdu_cod_acabar: tanca el paquet en construccio i en retorna la longitud (0 si no n'hi havia)
+ */
+static inline int bdu_cod_acabar(struct bdu_codificador *cod)
+{
+	int longitud = cod->paquet ? cod->longitud : 0;
+
+	cod->paquet = NULL;
+	cod->longitud = 0;
+	return longitud;
+}
+
+
+/**
+ *	bdu_cod_posar: afegeix un byte al paquet (hi ha d'haver espai, veure 'bdu_cod_espai')
+ */
+static inline void bdu_cod_posar(struct bdu_codificador *cod, unsigned char byte)
+{
+	cod->paquet[cod->longitud++] = byte;
+}
+
+
+/**
+ *	bdu_cod_copiar: copia al paquet tants bytes de 'bytes' com hi caben (fins a 'n') i en retorna el nombre
+ *		Si 'copia' no es NULL, hi deixa tambe els bytes copiats: son els que s'enviaran, encara que
+ *		l'origen canvii mentrestant (p.ex., si esta projectat a una aplicacio).
+ */
+static inline int bdu_cod_copiar(struct bdu_codificador *cod, const unsigned char *bytes, int n, unsigned char *copia)
+{
+	unsigned char *desti = cod->paquet + cod->longitud;
+
+	if (n > cod->mida - cod->longitud) n = cod->mida - cod->longitud;
+	memcpy(desti, bytes, n);
+	if (copia) memcpy(copia, desti, n);
+	cod->longitud += n;
+	return n;
+}
+
+
+/**
+ *	bdu_cod_enviar: envia el paquet en construccio (si n'hi ha)
+ */
+static inline int bdu_cod_enviar(struct bdu_codificador *cod)
+{
+	int longitud = bdu_cod_acabar(cod);
+
+	return longitud ? cod->enviar(cod->context, longitud) : 0;
+}
+
+
+/**
+ *	bdu_cod_obrir: deixa un paquet de 'tipus' en construccio amb lloc com a minim per a un byte
+ *		Si el paquet es d'un altre tipus o ja es ple, l'envia i en comença un de nou.
+ *		Si retorna un error, no queda cap paquet en construccio.
+ */
+static inline int bdu_cod_obrir(struct bdu_codificador *cod, unsigned char tipus)
+{
+	unsigned char *paquet;
+	int retval;
+
+	if (bdu_cod_espai(cod, tipus) > 0) return 0;
+	retval = bdu_cod_enviar(cod);
+	if (retval) return retval;
+	retval = cod->obtenir(cod->context, &paquet);
+	if (retval) return retval;
+	bdu_cod_comencar(cod, paquet, cod->mida, tipus);
+	return 0;
+}
+
+
+/**
+ *	bdu_cod_afegir: afegeix un byte de comanda (tipus 0x00) o de dades (tipus 0x01)
+ */
+static inline int bdu_cod_afegir(struct bdu_codificador *cod, unsigned char tipus, unsigned char byte)
+{
+	int retval;
+
+	retval = bdu_cod_obrir(cod, tipus);
+	if (retval) return retval;
+	bdu_cod_posar(cod, byte);
+	return 0;
+}
+
+
+/**
+ *	bdu_cod_afegir_bytes: afegeix 'n' bytes d'un mateix tipus, copiant-los de cop a cada paquet
+ *		Si 'copia' no es NULL, hi deixa els bytes tal com s'han posat als paquets.
+ */
+static inline int bdu_cod_afegir_bytes(struct bdu_codificador *cod, unsigned char tipus,
+				       const unsigned char *bytes, int n, unsigned char *copia)
+{
+	int fets, retval;
+
+	while (n > 0)
+	{
+		retval = bdu_cod_obrir(cod, tipus);
+		if (retval) return retval;
+		fets = bdu_cod_copiar(cod, bytes, n, copia);
+		bytes += fets;
+		if (copia) copia += fets;
+		n -= fets;
+	}
+	return 0;
+}
+
+
+/**
+ *	bdu_cod_adreca: adreça de la memoria del display (DDRAM) que correspon a una cel·la
+ *		Les files 0 i 1 comencen a 0x00 i 0x40; les files 2 i 3 continuen just despres de les anteriors.
+ */
+static inline int bdu_cod_adreca(int columnes, int cella)
+{
+	int fila = cella / columnes;
+
+	return ((fila & 1) ? ADRECA_FILA_SENAR : 0) + ((fila & 2) ? columnes : 0) + cella % columnes;
+}
+
+/**
+ *	bdu_cod_cursor: posa el cursor del display a 'cella' (si no hi es ja)
+ */
+static inline int bdu_cod_cursor(struct bdu_codificador *cod, int cella)
+{
+	int retval;
+
+	if (*cod->cursor == cella) return 0;
+	retval = bdu_cod_afegir(cod, TIPUS_COMANDA, COMANDA_CURSOR + bdu_cod_adreca(cod->columnes, cella));
+	if (retval) return retval;
+	*cod->cursor = cella;
+	return 0;
+}
+
+
+/**
+ *	bdu_cod_tram: escriu 'n' cel·les seguides d'una fila a partir de 'cella' (cursor si cal i dades)
+ *		Si 'copia' no es NULL, hi deixa les dades tal com s'han posat als paquets.
+ */
+static inline int bdu_cod_tram(struct bdu_codificador *cod, int cella, const unsigned char *bytes, int n,
+			       unsigned char *copia)
+{
+	int retval;
+
+	retval = bdu_cod_cursor(cod, cella);
+	if (retval) return retval;
+	retval = bdu_cod_afegir_bytes(cod, TIPUS_DADES, bytes, n, copia);
+	if (retval) return retval;
+	/* el display avança el cursor automaticament, pero no salta a la fila seguent */
+	*cod->cursor = ((cella + n) % cod->columnes) ? cella + n : -1;
+	return 0;
+}
+
+#endif /* BOTODISPUSB_CODIFICADOR_H */
@@ -0,0 +1,123 @@
+/**
+ *	Botodispusb driver : punts de traça (tracepoints)
+ *
+ *	Descripcio :
+ *		-> enviament i finalitzacio dels paquets cap al display (bulk_out)
+ *		-> recepcio de tecles (interrupt_in)
+ *		-> escriptures i lectures de les aplicacions
+ *
+ *		Sense activar-los no costen res; s'activen a /sys/kernel/debug/tracing/events/botodispusb/.
+ *		El Kbuild ha de trobar aquest fitxer: CFLAGS_botodispusb.o := -I$(src)
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM botodispusb
+
+#if !defined(_BOTODISPUSB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BOTODISPUSB_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* enviament d'un paquet de comandes (0x00) o de dades (0x01) des d'una entrada de l'anell de sortida */
+TRACE_EVENT(bdu_enviament,
+	TP_PROTO(int minor, int entrada, unsigned char tipus, int longitud, int retval),
+	TP_ARGS(minor, entrada, tipus, longitud, retval),
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(int,		entrada)
+		__field(unsigned char,	tipus)
+		__field(int,		longitud)
+		__field(int,		retval)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->entrada = entrada;
+		__entry->tipus = tipus;
+		__entry->longitud = longitud;
+		__entry->retval = retval;
+	),
+	TP_printk("minor=%d entrada=%d %s bytes=%d retval=%d", __entry->minor, __entry->entrada,
+		__entry->tipus ? "dades" : "comandes", __entry->longitud, __entry->retval)
+);
+
+/* el dispositiu ha acceptat (o no) un paquet cap al display */
+TRACE_EVENT(bdu_completat,
+	TP_PROTO(int minor, int entrada, int status, int longitud),
+	TP_ARGS(minor, entrada, status, longitud),
+	TP_STRUCT__entry(
+		__field(int,	minor)
+		__field(int,	entrada)
+		__field(int,	status)
+		__field(int,	longitud)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->entrada = entrada;
+		__entry->status = status;
+		__entry->longitud = longitud;
+	),
+	TP_printk("minor=%d entrada=%d status=%d bytes=%d", __entry->minor, __entry->entrada,
+		__entry->status, __entry->longitud)
+);
+
+/* el dispositiu ha enviat un codi de tecla */
+TRACE_EVENT(bdu_tecla,
+	TP_PROTO(int minor, unsigned char codi, int status),
+	TP_ARGS(minor, codi, status),
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(unsigned char,	codi)
+		__field(int,		status)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->codi = codi;
+		__entry->status = status;
+	),
+	TP_printk("minor=%d codi=0x%02x status=%d", __entry->minor, __entry->codi, __entry->status)
+);
+
+/* una aplicacio ha escrit al display ('write', 'pwrite', 'writev') */
+TRACE_EVENT(bdu_escriptura,
+	TP_PROTO(int minor, long long pos, size_t count, ssize_t retval),
+	TP_ARGS(minor, pos, count, retval),
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(long long,	pos)
+		__field(size_t,		count)
+		__field(ssize_t,	retval)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->retval = retval;
+	),
+	TP_printk("minor=%d pos=%lld bytes=%zu retval=%zd", __entry->minor, __entry->pos,
+		__entry->count, __entry->retval)
+);
+
+/* una aplicacio ha llegit tecles */
+TRACE_EVENT(bdu_lectura,
+	TP_PROTO(int minor, size_t count, ssize_t retval),
+	TP_ARGS(minor, count, retval),
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(size_t,		count)
+		__field(ssize_t,	retval)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->retval = retval;
+	),
+	TP_printk("minor=%d bytes=%zu retval=%zd", __entry->minor, __entry->count, __entry->retval)
+);
+
+#endif /* _BOTODISPUSB_TRACE_H */
+
+/* aquesta part ha de quedar fora de la proteccio contra inclusio multiple */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE botodispusb_trace
+#include <trace/define_trace.h>
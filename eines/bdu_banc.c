@@ -0,0 +1,329 @@
+/**
+ *	Botodispusb banc de proves : mesures del driver contra un display real o 'bdu_emulador'
+ *
+ *	Descripcio :
+ *		-> rendiment d'escriptura: 'n' escriptures de 'm' bytes a la cel·la 0 (tan rapid com es pugui
+ *		   o al ritme demanat), en escriptures/s i bytes/s, i paquets USB per actualitzacio
+ *		   (comptats per l'emulador: nomes es mostren si respon pel socket de control).
+ *		   Cada escriptura gira el text una posicio, perque el driver hagi d'enviar totes les cel·les
+ *		   (un text igual que el del display no envia res). Si l'anell de sortida es ple (EAGAIN),
+ *		   s'espera POLLOUT i es torna a provar: nomes es compten les escriptures acceptades
+ *		-> latencia tecla -> eco i perdua de tecles sota carrega: es demana a l'emulador que premi
+ *		   tecles mentre aquest programa les llegeix amb 'read' i, alhora, escriu al display.
+ *		   Les tecles que l'emulador ha enviat i no arriben a 'read' son tecles perdudes; les xifres
+ *		   que no s'han vist al display (en menys d'1 s) son ecos perduts
+ *
+ *	Us :
+ *		bdu_banc [-d dispositiu] [-s socket] [-n escriptures] [-m bytes] [-r escriptures_per_s]
+ *			 [-t tecles_per_s] [-k tecles]
+ *		p.ex. rendiment:		bdu_banc -n 10000 -m 8
+ *		      latencia sense carrega:	bdu_banc -n 0 -t 50 -k 1000
+ *		      latencia amb carrega:	bdu_banc -n 20000 -r 2000 -t 50 -k 1000
+ *
+ *	Compilacio (des del directori 'eines') :
+ *		gcc -O2 -Wall -pthread -I.. -o bdu_banc bdu_banc.c
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "botodispusb.h"
+
+/**
+ *	DECLARACIO DE CONSTANTS
+ */
+#define DISPOSITIU_DEF		"/dev/bd_usb0"
+#define SOCKET_DEF		"/tmp/bdu_emulador.sock"	/* socket de control de 'bdu_emulador' */
+#define MIDA_MISSATGE		512
+#define ESPERA_RESPOSTA_MS	1000	/* temps maxim d'espera d'una resposta de l'emulador */
+#define ESPERA_TECLES_S		60	/* temps maxim d'espera de la injeccio de tecles */
+#define ESPERA_ESCRIPTURA_MS	5000	/* temps maxim d'espera de lloc a l'anell de sortida (POLLOUT) */
+
+/**
+ *	Comptadors de l'emulador (resposta a "estat")
+ */
+struct estat_emulador
+{
+	unsigned long	paquets, bytes, tecles, ecos, ecos_perduts;
+	unsigned long	p50, p99, max;
+	unsigned int	injectant;
+};
+
+static int control = -1;		// socket de control (-1 si no hi ha emulador)
+static volatile int llegint = 1;	// el fil lector continua
+static unsigned long tecles_llegides;
+
+
+
+/**
+ *	ara_s: temps monotonic en segons
+ */
+static double ara_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/**
+ *	connectar_emulador: obre el socket de control (amb adreça propia, perque l'emulador pugui respondre)
+ */
+static int connectar_emulador(const char *cami)
+{
+	struct sockaddr_un adreca;
+	int s;
+
+	s = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (s < 0) return -1;
+
+	memset(&adreca, 0, sizeof(adreca));
+	adreca.sun_family = AF_UNIX;
+	snprintf(adreca.sun_path, sizeof(adreca.sun_path), "/tmp/bdu_banc.%d", (int) getpid());
+	unlink(adreca.sun_path);
+	if (bind(s, (struct sockaddr *) &adreca, sizeof(adreca)))
+		goto error;
+
+	memset(&adreca, 0, sizeof(adreca));
+	adreca.sun_family = AF_UNIX;
+	strncpy(adreca.sun_path, cami, sizeof(adreca.sun_path) - 1);
+	if (connect(s, (struct sockaddr *) &adreca, sizeof(adreca)))
+		goto error;
+	return s;
+
+error:
+	close(s);
+	return -1;
+}
+
+
+/**
+ *	demanar: envia una peticio a l'emulador i n'espera la resposta
+ */
+static int demanar(const char *peticio, char *resposta, size_t mida)
+{
+	struct pollfd pfd = { .fd = control, .events = POLLIN };
+	ssize_t n;
+
+	if (control < 0) return -1;
+	if (send(control, peticio, strlen(peticio), 0) < 0) return -1;
+	if (poll(&pfd, 1, ESPERA_RESPOSTA_MS) != 1) return -1;
+	n = recv(control, resposta, mida - 1, 0);
+	if (n < 0) return -1;
+	resposta[n] = '\0';
+	return strncmp(resposta, "error", 5) ? 0 : -1;
+}
+
+
+/**
+ *	llegir_estat: demana els comptadors de l'emulador
+ */
+static int llegir_estat(struct estat_emulador *e)
+{
+	char r[MIDA_MISSATGE];
+
+	if (demanar("estat", r, sizeof(r))) return -1;
+	if (sscanf(r, "paquets=%lu bytes=%lu comandes=%*u dades=%*u netejades=%*u tecles=%lu ecos=%lu ecos_perduts=%lu "
+		   "latencia_p50_us=%lu latencia_p99_us=%lu latencia_max_us=%lu injectant=%u",
+		   &e->paquets, &e->bytes, &e->tecles, &e->ecos, &e->ecos_perduts,
+		   &e->p50, &e->p99, &e->max, &e->injectant) != 9)
+		return -1;
+	return 0;
+}
+
+
+/**
+ *	celles_display: cel·les del display segons l'atribut sysfs 'geometria' (0 si no es pot llegir)
+ */
+static int celles_display(const char *dispositiu)
+{
+	char cami[256], nom[64];
+	int files = 0, columnes = 0;
+	FILE *f;
+
+	snprintf(nom, sizeof(nom), "%s", dispositiu);
+	snprintf(cami, sizeof(cami), "/sys/class/usbmisc/%s/device/geometria", basename(nom));
+	f = fopen(cami, "r");
+	if (!f) return 0;
+	if (fscanf(f, "%dx%d", &files, &columnes) != 2) files = 0;
+	fclose(f);
+	return files * columnes;
+}
+
+
+/**
+ *	fil_lector: llegeix (i compta) les tecles fins que s'acaba la prova
+ */
+static void *fil_lector(void *arg)
+{
+	int fd = *(int *) arg;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char tecles[256];
+	ssize_t n;
+
+	while (llegint)
+	{
+		if (poll(&pfd, 1, 100) != 1) continue;
+		n = read(fd, tecles, sizeof(tecles));
+		if (n > 0) tecles_llegides += n;
+		else if ((n < 0) && (errno != EAGAIN) && (errno != EINTR)) break;
+	}
+	return NULL;
+}
+
+
+/**
+ *	esperar: dorm fins a l'instant 'seguent' i el fa avançar un periode de 'per_segon'
+ */
+static void esperar(struct timespec *seguent, unsigned int per_segon)
+{
+	seguent->tv_nsec += 1000000000L / per_segon;
+	while (seguent->tv_nsec >= 1000000000L)
+	{
+		seguent->tv_nsec -= 1000000000L;
+		seguent->tv_sec++;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, seguent, NULL);
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *dispositiu = DISPOSITIU_DEF, *cami_socket = SOCKET_DEF;
+	unsigned int escriptures = 1000, mida = 8, ritme = 0, tecles_per_s = 50, tecles = 0, i;
+	struct estat_emulador abans, despres;
+	char text[256], peticio[64], r[MIDA_MISSATGE];
+	struct pollfd pfd;
+	struct timespec seguent;
+	double inici, durada = 0;
+	pthread_t lector;
+	int fd, opcio, celles, hi_ha_emulador, j;
+	ssize_t n;
+
+	while ((opcio = getopt(argc, argv, "d:s:n:m:r:t:k:")) != -1)
+	{
+		switch (opcio)
+		{
+			case 'd': dispositiu = optarg; break;
+			case 's': cami_socket = optarg; break;
+			case 'n': escriptures = atoi(optarg); break;
+			case 'm': mida = atoi(optarg); break;
+			case 'r': ritme = atoi(optarg); break;
+			case 't': tecles_per_s = atoi(optarg); break;
+			case 'k': tecles = atoi(optarg); break;
+			default:
+				fprintf(stderr, "us: %s [-d dispositiu] [-s socket] [-n escriptures] [-m bytes] "
+					"[-r escriptures_per_s] [-t tecles_per_s] [-k tecles]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	fd = open(dispositiu, O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+	{
+		perror(dispositiu);
+		return 1;
+	}
+
+	/* el text no pot arribar a l'ultima cel·la: l'eco necessita el cursor dins del display */
+	celles = celles_display(dispositiu);
+	if (mida > sizeof(text)) mida = sizeof(text);
+	if ((celles > 0) && (mida >= (unsigned int) celles)) mida = celles - 1;
+
+	control = connectar_emulador(cami_socket);
+	hi_ha_emulador = (control >= 0) && (demanar("zero", r, sizeof(r)) == 0);
+	if (!hi_ha_emulador)
+	{
+		fprintf(stderr, "bdu_banc: sense emulador a %s: nomes es mesura el rendiment d'escriptura\n", cami_socket);
+		tecles = 0;
+	}
+	memset(&abans, 0, sizeof(abans));
+
+	pthread_create(&lector, NULL, fil_lector, &fd);
+	if (tecles)
+	{
+		snprintf(peticio, sizeof(peticio), "tecles %u %u", tecles_per_s, tecles);
+		if (demanar(peticio, r, sizeof(r)))
+		{
+			fprintf(stderr, "bdu_banc: l'emulador no accepta la peticio: %s", r);
+			tecles = 0;
+		}
+	}
+
+	/* carrega d'escriptura: 'i' son les escriptures acceptades */
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	inici = ara_s();
+	clock_gettime(CLOCK_MONOTONIC, &seguent);
+	for (i = 0; i < escriptures; i++)
+	{
+		for (j = 0; j < (int) mida; j++)
+			text[j] = 'a' + (i + j) % 26;
+		while (((n = pwrite(fd, text, mida, 0)) < 0) && (errno == EAGAIN))
+		{
+			if (poll(&pfd, 1, ESPERA_ESCRIPTURA_MS) == 0)
+			{
+				errno = ETIMEDOUT;
+				break;
+			}
+		}
+		if (n < 0)
+		{
+			perror("pwrite");
+			break;
+		}
+		if (ritme) esperar(&seguent, ritme);
+	}
+	ioctl(fd, BDU_IOC_REFRESCAR);	// envia el que esperava la coalescencia
+	durada = ara_s() - inici;
+
+	/* espera que l'emulador acabi de premer tecles i que arribin els ultims paquets */
+	if (tecles)
+	{
+		inici = ara_s();
+		while ((llegir_estat(&despres) == 0) && despres.injectant && (ara_s() - inici < ESPERA_TECLES_S))
+			usleep(100000);
+	}
+	usleep(200000);
+	llegint = 0;
+	pthread_join(lector, NULL);
+
+	/* resultats */
+	if (escriptures)
+	{
+		printf("escriptures:            %u de %u bytes en %.3f s\n", i, mida, durada);
+		printf("rendiment:              %.0f escriptures/s, %.0f bytes/s\n", i / durada, i * mida / durada);
+	}
+	if (hi_ha_emulador && (llegir_estat(&despres) == 0))
+	{
+		if (i)
+			printf("paquets per escriptura: %.3f (%.1f bytes USB per escriptura)\n",
+				(double) (despres.paquets - abans.paquets) / i, (double) (despres.bytes - abans.bytes) / i);
+		if (tecles)
+		{
+			printf("latencia tecla -> eco:  p50 %lu us, p99 %lu us, max %lu us\n",
+				despres.p50, despres.p99, despres.max);
+			printf("tecles:                 %lu enviades, %lu llegides, %ld perdudes\n",
+				despres.tecles, tecles_llegides, (long) (despres.tecles - tecles_llegides));
+			printf("ecos:                   %lu vistos, %lu perduts\n", despres.ecos, despres.ecos_perduts);
+		}
+	}
+
+	close(fd);
+	if (control >= 0)
+	{
+		snprintf(r, sizeof(r), "/tmp/bdu_banc.%d", (int) getpid());
+		unlink(r);
+	}
+	return 0;
+}
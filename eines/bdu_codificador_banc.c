@@ -0,0 +1,224 @@
+/**
+ *	Botodispusb banc del codificador : rendiment de l'empaquetament de comandes i dades
+ *
+ *	Descripcio :
+ *		-> codifica repetidament el redibuixat complet d'un display (per cada fila, una comanda de
+ *		   cursor i les dades de la fila) amb el mateix codificador que el driver
+ *		   (botodispusb_codificador.h), sense USB: els paquets es deixen en un anell de buffers
+ *		-> compara l'afegit byte a byte ('bdu_cod_afegir') amb la copia de trams ('bdu_cod_tram')
+ *		   i comprova que els dos generen els mateixos paquets
+ *		-> dona actualitzacions/s, bytes codificats/s, ns per byte i paquets per actualitzacio
+ *
+ *	Us :
+ *		bdu_codificador_banc [-g FILESxCOLUMNES] [-m mida_paquet] [-n actualitzacions]
+ *
+ *	Compilacio (des del directori 'eines') :
+ *		gcc -O2 -Wall -I.. -o bdu_codificador_banc bdu_codificador_banc.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "botodispusb_codificador.h"
+
+/**
+ *	DECLARACIO DE CONSTANTS
+ */
+#define NUM_PAQUETS		64	/* buffers minims de l'anell de paquets (com l'anell de sortida del driver) */
+#define MIDA_PAQUET_MAX		512
+#define MAX_CELLES		80	/* mida de la DDRAM del display */
+
+/**
+ *	Anell de paquets que fa de bulk_out_endpoint
+ */
+struct anell
+{
+	unsigned char	*buffers;	// 'num' buffers de 'mida' bytes
+	int		num;		// prou buffers per a un redibuixat sencer (per poder-lo comprovar)
+	int		seguent;	// buffer que es fara servir per al proper paquet
+	int		mida;		// mida maxima dels paquets
+	unsigned long	paquets, bytes;	// paquets i bytes "enviats"
+	unsigned long	suma;		// suma dels bytes enviats (perque el compilador no se'ls estalvii)
+};
+
+static struct anell anell;
+
+
+
+/**
+ *	paquet_anell: buffer 'i' de l'anell (modul el nombre de buffers)
+ */
+static unsigned char *paquet_anell(int i)
+{
+	return anell.buffers + (size_t) (i % anell.num) * anell.mida;
+}
+
+
+/**
+ *	obtenir: dona al codificador el buffer seguent de l'anell (funcio 'obtenir' del codificador)
+ */
+static int obtenir(void *context, unsigned char **paquet)
+{
+	*paquet = paquet_anell(anell.seguent);
+	anell.seguent = (anell.seguent + 1) % anell.num;
+	return 0;
+}
+
+
+/**
+ *	enviar: compta el paquet acabat com a enviat (funcio 'enviar' del codificador)
+ */
+static int enviar(void *context, int longitud)
+{
+	anell.paquets++;
+	anell.bytes += longitud;
+	anell.suma += paquet_anell(anell.seguent + anell.num - 1)[longitud - 1];
+	return 0;
+}
+
+
+/**
+ *	redibuixar_bytes: codifica tot el display afegint les dades byte a byte
+ */
+static void redibuixar_bytes(struct bdu_codificador *cod, const unsigned char *celles, int files, int columnes)
+{
+	int f, c;
+
+	for (f = 0; f < files; f++)
+	{
+		bdu_cod_cursor(cod, f * columnes);
+		for (c = 0; c < columnes; c++)
+			bdu_cod_afegir(cod, TIPUS_DADES, celles[f * columnes + c]);
+		*cod->cursor = -1;	// com 'bdu_cod_tram': el display no salta de fila
+	}
+	bdu_cod_enviar(cod);
+}
+
+
+/**
+ *	redibuixar_trams: codifica tot el display copiant cada fila de cop (com el driver)
+ */
+static void redibuixar_trams(struct bdu_codificador *cod, const unsigned char *celles, int files, int columnes)
+{
+	int f;
+
+	for (f = 0; f < files; f++)
+		bdu_cod_tram(cod, f * columnes, &celles[f * columnes], columnes, NULL);
+	bdu_cod_enviar(cod);
+}
+
+
+/**
+ *	ara_s: temps monotonic en segons
+ */
+static double ara_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/**
+ *	mesurar: executa 'n' redibuixats amb 'redibuixar' i n'escriu el rendiment
+ */
+static void mesurar(const char *nom, void (*redibuixar)(struct bdu_codificador *, const unsigned char *, int, int),
+		    const unsigned char *celles, int files, int columnes, unsigned long n)
+{
+	struct bdu_codificador cod;
+	unsigned long i;
+	int cursor = -1;
+	double durada;
+
+	bdu_cod_iniciar(&cod, anell.mida, columnes, &cursor, obtenir, enviar, NULL);
+	anell.paquets = anell.bytes = anell.suma = 0;
+	durada = ara_s();
+	for (i = 0; i < n; i++)
+		redibuixar(&cod, celles, files, columnes);
+	durada = ara_s() - durada;
+
+	printf("%-8s %12.0f actualitzacions/s %10.1f MB/s %8.2f ns/byte %6.2f paquets/actualitzacio (%lx)\n",
+		nom, n / durada, anell.bytes / durada / 1e6, durada * 1e9 / anell.bytes,
+		(double) anell.paquets / n, anell.suma & 0xf);
+}
+
+
+/**
+ *	comprovar: verifica que els dos redibuixats generen exactament els mateixos paquets
+ */
+static int comprovar(const unsigned char *celles, int files, int columnes)
+{
+	size_t mida = (size_t) anell.num * anell.mida;
+	struct bdu_codificador cod;
+	unsigned char *primers;
+	unsigned long paquets;
+	int cursor = -1, retval;
+
+	primers = malloc(mida);
+	if (!primers) return -1;
+	memset(anell.buffers, 0, mida);
+	anell.seguent = 0;
+	anell.paquets = 0;
+	bdu_cod_iniciar(&cod, anell.mida, columnes, &cursor, obtenir, enviar, NULL);
+	redibuixar_bytes(&cod, celles, files, columnes);
+	memcpy(primers, anell.buffers, mida);
+	paquets = anell.paquets;
+
+	memset(anell.buffers, 0, mida);
+	anell.seguent = 0;
+	anell.paquets = 0;
+	cursor = -1;
+	redibuixar_trams(&cod, celles, files, columnes);
+	retval = ((paquets == anell.paquets) && (paquets <= (unsigned long) anell.num) && !memcmp(primers, anell.buffers, mida)) ? 0 : -1;
+	free(primers);
+	return retval;
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned char celles[MAX_CELLES];
+	unsigned long n = 10000000;
+	int files = 4, columnes = 20, opcio, i;
+
+	anell.mida = 64;
+	while ((opcio = getopt(argc, argv, "g:m:n:")) != -1)
+	{
+		switch (opcio)
+		{
+			case 'g': sscanf(optarg, "%dx%d", &files, &columnes); break;
+			case 'm': anell.mida = atoi(optarg); break;
+			case 'n': n = strtoul(optarg, NULL, 10); break;
+			default:
+				fprintf(stderr, "us: %s [-g FILESxCOLUMNES] [-m mida_paquet] [-n actualitzacions]\n", argv[0]);
+				return 1;
+		}
+	}
+	if ((files < 1) || (columnes < 1) || (files * columnes > MAX_CELLES) ||
+	    (anell.mida < 2) || (anell.mida > MIDA_PAQUET_MAX) || (n == 0))
+	{
+		fprintf(stderr, "bdu_codificador_banc: parametres incorrectes\n");
+		return 1;
+	}
+
+	/* per fila, un paquet de comanda i els de dades: tot el redibuixat ha de cabre a l'anell */
+	anell.num = files * (1 + (columnes + anell.mida - 2) / (anell.mida - 1));
+	if (anell.num < NUM_PAQUETS) anell.num = NUM_PAQUETS;
+	anell.buffers = malloc((size_t) anell.num * anell.mida);
+	if (!anell.buffers) return 1;
+
+	for (i = 0; i < files * columnes; i++)
+		celles[i] = 'a' + i % 26;
+	if (comprovar(celles, files, columnes))
+	{
+		fprintf(stderr, "bdu_codificador_banc: els dos codificats no coincideixen\n");
+		return 1;
+	}
+
+	printf("display %dx%d, paquets de %d bytes, %lu actualitzacions\n", files, columnes, anell.mida, n);
+	mesurar("bytes", redibuixar_bytes, celles, files, columnes, n);
+	mesurar("trams", redibuixar_trams, celles, files, columnes, n);
+	return 0;
+}
@@ -0,0 +1,243 @@
+/**
+ *	Botodispusb prova del codificador : paquets esperats escrits a ma
+ *
+ *	Descripcio :
+ *		-> comprova el codificador del driver (botodispusb_codificador.h), el mateix codi que empaqueta
+ *		   els enviaments del driver, contra paquets calculats a ma a partir del protocol del display,
+ *		   no contra una altra implementacio:
+ *			adreces de la DDRAM de l'inici de cada fila d'un display 4x20 (0x80, 0xC0, 0x94, 0xD4)
+ *			un tram de dades que no cap en un paquet es parteix en dos
+ *			canvis de tipus (comandes <-> dades) obren paquets nous
+ *			comanda de cursor nomes quan el display no hi es ja (tampoc despres del final d'una fila)
+ *			un error en obtenir un paquet arriba a qui afegeix els bytes
+ *		-> escriu les comprovacions que fallen i acaba amb codi 1 si n'hi ha alguna
+ *
+ *	Compilacio i execucio (des del directori 'eines') :
+ *		gcc -O2 -Wall -I.. -o bdu_codificador_prova bdu_codificador_prova.c && ./bdu_codificador_prova
+ */
+#include <stdio.h>
+#include <string.h>
+#include "botodispusb_codificador.h"
+
+/**
+ *	DECLARACIO DE CONSTANTS
+ */
+#define MAX_PAQUETS		16
+#define MIDA_PAQUET_MAX		64
+
+#define COMPROVAR(condicio)							\
+	do									\
+	{									\
+		if (!(condicio))						\
+		{								\
+			printf("%s:%d: falla '%s'\n", __FILE__, __LINE__, #condicio);	\
+			errors++;						\
+		}								\
+	} while (0)
+
+/**
+ *	Paquets "enviats" per les proves
+ */
+struct enviats
+{
+	unsigned char	paquets[MAX_PAQUETS][MIDA_PAQUET_MAX];
+	int		longituds[MAX_PAQUETS];
+	int		num;		// paquets enviats
+	int		obtinguts;	// paquets demanats al codificador
+	int		error;		// error que retorna 'obtenir' (0 per funcionar)
+	int		cursor;		// cursor del display que segueix el codificador
+};
+
+static int errors;
+
+
+
+/**
+ *	obtenir: dona al codificador el buffer del proper paquet (funcio 'obtenir' del codificador)
+ */
+static int obtenir(void *context, unsigned char **paquet)
+{
+	struct enviats *e = context;
+
+	if (e->error) return e->error;
+	if (e->obtinguts == MAX_PAQUETS) return -1;
+	*paquet = e->paquets[e->obtinguts++];
+	return 0;
+}
+
+
+/**
+ *	enviar: apunta la longitud del paquet acabat (funcio 'enviar' del codificador)
+ */
+static int enviar(void *context, int longitud)
+{
+	struct enviats *e = context;
+
+	e->longituds[e->num++] = longitud;
+	return 0;
+}
+
+
+/**
+ *	iniciar: codificador sense paquets enviats, amb el cursor del display desconegut
+ */
+static void iniciar(struct enviats *e, struct bdu_codificador *cod, int mida, int columnes)
+{
+	memset(e, 0, sizeof(*e));
+	e->cursor = -1;
+	bdu_cod_iniciar(cod, mida, columnes, &e->cursor, obtenir, enviar, e);
+}
+
+
+/**
+ *	es_paquet: compara el paquet 'i' amb els bytes esperats
+ */
+static int es_paquet(const struct enviats *e, int i, const unsigned char *esperat, int longitud)
+{
+	return (i < e->num) && (e->longituds[i] == longitud) && !memcmp(e->paquets[i], esperat, longitud);
+}
+
+
+/**
+ *	prova_adreces: adreça de la DDRAM de cada fila (i d'una cel·la del mig) d'un display 4x20
+ */
+static void prova_adreces(void)
+{
+	COMPROVAR(COMANDA_CURSOR + bdu_cod_adreca(20, 0) == 0x80);
+	COMPROVAR(COMANDA_CURSOR + bdu_cod_adreca(20, 20) == 0xC0);
+	COMPROVAR(COMANDA_CURSOR + bdu_cod_adreca(20, 40) == 0x94);
+	COMPROVAR(COMANDA_CURSOR + bdu_cod_adreca(20, 60) == 0xD4);
+	COMPROVAR(COMANDA_CURSOR + bdu_cod_adreca(20, 79) == 0xE7);	// ultima cel·la de la fila 3
+	COMPROVAR(COMANDA_CURSOR + bdu_cod_adreca(16, 17) == 0xC1);	// 2x16: fila 1, columna 1
+}
+
+
+/**
+ *	prova_paquet_ple: 10 bytes de dades en paquets de 8 (tipus + 7 dades) fan dos paquets
+ */
+static void prova_paquet_ple(void)
+{
+	static const unsigned char primer[] = { TIPUS_DADES, 'a', 'b', 'c', 'd', 'e', 'f', 'g' };
+	static const unsigned char segon[] = { TIPUS_DADES, 'h', 'i', 'j' };
+	struct bdu_codificador cod;
+	struct enviats e;
+	unsigned char copia[10];
+
+	iniciar(&e, &cod, 8, 20);
+	COMPROVAR(bdu_cod_afegir_bytes(&cod, TIPUS_DADES, (const unsigned char *) "abcdefghij", 10, copia) == 0);
+	COMPROVAR(bdu_cod_espai(&cod, TIPUS_DADES) == 4);
+	COMPROVAR(bdu_cod_espai(&cod, TIPUS_COMANDA) == 0);
+	COMPROVAR(bdu_cod_enviar(&cod) == 0);
+	COMPROVAR(bdu_cod_enviar(&cod) == 0);		// ja no hi ha cap paquet en construccio
+
+	COMPROVAR(e.num == 2);
+	COMPROVAR(es_paquet(&e, 0, primer, sizeof(primer)));
+	COMPROVAR(es_paquet(&e, 1, segon, sizeof(segon)));
+	COMPROVAR(memcmp(copia, "abcdefghij", 10) == 0);
+
+	/* un paquet ple no admet res mes, ni del mateix tipus: el byte seguent en comença un altre */
+	iniciar(&e, &cod, 2, 20);
+	COMPROVAR(bdu_cod_afegir(&cod, TIPUS_DADES, 'x') == 0);
+	COMPROVAR(bdu_cod_espai(&cod, TIPUS_DADES) == 0);
+	COMPROVAR(bdu_cod_afegir(&cod, TIPUS_DADES, 'y') == 0);
+	COMPROVAR(bdu_cod_enviar(&cod) == 0);
+	COMPROVAR(e.num == 2);
+	COMPROVAR(es_paquet(&e, 0, (const unsigned char *) "\001x", 2));
+	COMPROVAR(es_paquet(&e, 1, (const unsigned char *) "\001y", 2));
+}
+
+
+/**
+ *	prova_canvi_tipus: cursor a la fila 0, "ab", cursor a la fila 1, esborrat, "c" (2x16, paquets de 64)
+ */
+static void prova_canvi_tipus(void)
+{
+	static const unsigned char p0[] = { TIPUS_COMANDA, 0x80 };
+	static const unsigned char p1[] = { TIPUS_DADES, 'a', 'b' };
+	static const unsigned char p2[] = { TIPUS_COMANDA, 0xC0, COMANDA_NETEJAR };
+	static const unsigned char p3[] = { TIPUS_DADES, 'c' };
+	struct bdu_codificador cod;
+	struct enviats e;
+
+	iniciar(&e, &cod, 64, 16);
+	COMPROVAR(bdu_cod_tram(&cod, 0, (const unsigned char *) "ab", 2, NULL) == 0);
+	COMPROVAR(e.cursor == 2);
+	COMPROVAR(bdu_cod_cursor(&cod, 16) == 0);
+	COMPROVAR(bdu_cod_afegir(&cod, TIPUS_COMANDA, COMANDA_NETEJAR) == 0);	// mateix tipus: mateix paquet
+	COMPROVAR(bdu_cod_afegir_bytes(&cod, TIPUS_DADES, (const unsigned char *) "c", 1, NULL) == 0);
+	COMPROVAR(bdu_cod_enviar(&cod) == 0);
+
+	COMPROVAR(e.num == 4);
+	COMPROVAR(es_paquet(&e, 0, p0, sizeof(p0)));
+	COMPROVAR(es_paquet(&e, 1, p1, sizeof(p1)));
+	COMPROVAR(es_paquet(&e, 2, p2, sizeof(p2)));
+	COMPROVAR(es_paquet(&e, 3, p3, sizeof(p3)));
+}
+
+
+/**
+ *	prova_cursor: trams d'un display 2x16; el cursor nomes es posa si el display no hi es ja
+ *		"xy" a les columnes 14 i 15 de la fila 0 (cursor 0x8E), "z" just a continuacio: el display
+ *		no salta de fila sol, cal el cursor 0xC0. "w" darrere de "z" ja no el necessita.
+ */
+static void prova_cursor(void)
+{
+	static const unsigned char p0[] = { TIPUS_COMANDA, 0x8E };
+	static const unsigned char p1[] = { TIPUS_DADES, 'x', 'y' };
+	static const unsigned char p2[] = { TIPUS_COMANDA, 0xC0 };
+	static const unsigned char p3[] = { TIPUS_DADES, 'z', 'w' };
+	struct bdu_codificador cod;
+	struct enviats e;
+
+	iniciar(&e, &cod, 64, 16);
+	COMPROVAR(bdu_cod_tram(&cod, 14, (const unsigned char *) "xy", 2, NULL) == 0);
+	COMPROVAR(e.cursor == -1);
+	COMPROVAR(bdu_cod_tram(&cod, 16, (const unsigned char *) "z", 1, NULL) == 0);
+	COMPROVAR(bdu_cod_tram(&cod, 17, (const unsigned char *) "w", 1, NULL) == 0);
+	COMPROVAR(bdu_cod_cursor(&cod, 18) == 0);	// el display ja hi es: cap comanda
+	COMPROVAR(bdu_cod_enviar(&cod) == 0);
+
+	COMPROVAR(e.num == 4);
+	COMPROVAR(es_paquet(&e, 0, p0, sizeof(p0)));
+	COMPROVAR(es_paquet(&e, 1, p1, sizeof(p1)));
+	COMPROVAR(es_paquet(&e, 2, p2, sizeof(p2)));
+	COMPROVAR(es_paquet(&e, 3, p3, sizeof(p3)));
+}
+
+
+/**
+ *	prova_error: si no es pot obtenir un paquet, l'error arriba a qui afegeix i no queda cap paquet obert
+ */
+static void prova_error(void)
+{
+	struct bdu_codificador cod;
+	struct enviats e;
+
+	iniciar(&e, &cod, 8, 16);
+	COMPROVAR(bdu_cod_afegir(&cod, TIPUS_DADES, 'a') == 0);
+	e.error = -11;
+	COMPROVAR(bdu_cod_tram(&cod, 16, (const unsigned char *) "b", 1, NULL) == -11);
+	COMPROVAR(e.num == 1);				// el paquet de dades s'ha enviat abans de demanar-ne un altre
+	COMPROVAR(e.cursor == -1);			// la comanda de cursor no ha arribat al display
+	COMPROVAR(bdu_cod_espai(&cod, TIPUS_COMANDA) == 0);
+	COMPROVAR(bdu_cod_enviar(&cod) == 0);
+	COMPROVAR(e.num == 1);
+}
+
+
+int main(void)
+{
+	prova_adreces();
+	prova_paquet_ple();
+	prova_canvi_tipus();
+	prova_cursor();
+	prova_error();
+
+	if (errors)
+	{
+		printf("bdu_codificador_prova: %d comprovacions fallades\n", errors);
+		return 1;
+	}
+	printf("bdu_codificador_prova: correcte\n");
+	return 0;
+}
@@ -0,0 +1,584 @@
+/**
+ *	Botodispusb emulador : dispositiu USB 'botodispusb' fet per programari (FunctionFS)
+ *
+ *	Descripcio :
+ *		-> fa de dispositiu 0x04d8:0x00bd sense el maquinari: un endpoint bulk_out pel display i un
+ *		   endpoint interrupt_in pel teclat, amb el mateix protocol que el display real
+ *		   (primer byte de cada paquet: 0x00 comandes HD44780, 0x01 dades)
+ *		-> emula la memoria del display (DDRAM i CGRAM) i en compta paquets, bytes, comandes i dades
+ *		-> injecta tecles al ritme que se li demana: alterna una xifra ('0' .. '9') i la tecla 'F'
+ *		   (esborrat, accio per defecte del driver) perque l'eco no faci avançar el cursor.
+ *		   Abans de premer la 'F' espera l'eco de la xifra, i en mesura la latencia tecla -> eco
+ *		-> socket de control (unix, datagrames) per a 'bdu_banc' o qualsevol altra eina:
+ *			"tecles <per_segon> <nombre>"	comença a injectar tecles
+ *			"estat"				respon els comptadors (clau=valor)
+ *			"zero"				posa els comptadors a zero
+ *			"pantalla"			respon el contingut del display
+ *
+ *	Preparacio (nucli amb configfs, libcomposite, usb_f_fs i dummy_hcd) :
+ *		modprobe dummy_hcd is_high_speed=0		(el display real es full speed)
+ *		modprobe libcomposite
+ *		mount -t configfs none /sys/kernel/config
+ *		cd /sys/kernel/config/usb_gadget && mkdir bdu && cd bdu
+ *		echo 0x04d8 > idVendor && echo 0x00bd > idProduct
+ *		mkdir configs/c.1 functions/ffs.bdu
+ *		echo 0xa0 > configs/c.1/bmAttributes		(despertar remot)
+ *		ln -s functions/ffs.bdu configs/c.1/
+ *		mkdir -p /dev/ffs-bdu && mount -t functionfs bdu /dev/ffs-bdu
+ *		bdu_emulador /dev/ffs-bdu &
+ *		ls /sys/class/udc > /sys/kernel/config/usb_gadget/bdu/UDC
+ *
+ *	Compilacio :
+ *		gcc -O2 -Wall -pthread -o bdu_emulador bdu_emulador.c
+ */
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+/**
+ *	DECLARACIO DE CONSTANTS
+ */
+#define SOCKET_DEF		"/tmp/bdu_emulador.sock"	/* socket de control per defecte */
+#define MIDA_PAQUET		64	/* wMaxPacketSize del bulk_out_endpoint (full speed) */
+#define MIDA_DDRAM		128	/* adreces de la memoria de caracters (0x00 .. 0x7f) */
+#define MIDA_CGRAM		64	/* 8 glifs de 8 files */
+#define TIPUS_COMANDA		0x00	/* primer byte d'un paquet de comandes */
+#define TIPUS_DADES		0x01	/* primer byte d'un paquet de dades */
+#define ESPERA_ECO_MS		1000	/* temps maxim d'espera de l'eco d'una xifra */
+#define MAX_LATENCIES		(1 << 20)	/* mesures de latencia que es guarden per calcular percentils */
+#define MIDA_MISSATGE		512	/* mida maxima dels missatges del socket de control */
+
+/* ordre de bytes USB en inicialitzadors constants ('htole32' no ho es) */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define LE16(x)			(x)
+#define LE32(x)			(x)
+#else
+#define LE16(x)			__builtin_bswap16(x)
+#define LE32(x)			__builtin_bswap32(x)
+#endif
+
+/**
+ *	Estat del display i comptadors (protegits per 'mutex')
+ */
+struct emulador
+{
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond_eco;	// s'ha vist l'eco de la xifra pendent
+	pthread_cond_t	cond_tecles;	// s'ha demanat una tanda de tecles
+
+	/* display */
+	unsigned char	ddram[MIDA_DDRAM];
+	unsigned char	cgram[MIDA_CGRAM];
+	int		adreca;		// adreça actual (DDRAM o CGRAM)
+	int		a_cgram;	// l'ultima comanda d'adreça era de la CGRAM
+	int		files, columnes;
+
+	/* comptadors */
+	unsigned long	paquets, bytes, comandes, dades, netejades;
+	unsigned long	tecles, ecos, ecos_perduts;
+	unsigned long	*latencies;	// latencies tecla -> eco (us)
+	unsigned long	num_latencies;
+
+	/* tecles */
+	unsigned char	xifra_pendent;	// xifra de la qual s'espera l'eco (0 si cap)
+	struct timespec	t_xifra;	// moment en que s'ha premut
+	unsigned int	tecles_per_segon, tecles_demanades;
+};
+
+static struct emulador emu =
+{
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond_eco = PTHREAD_COND_INITIALIZER,
+	.cond_tecles = PTHREAD_COND_INITIALIZER,
+	.files = 1,
+	.columnes = 16,
+};
+
+static int ep0, ep_display, ep_teclat;
+
+
+/**
+ *	Descriptors del dispositiu (nomes full speed, com el display real)
+ */
+static const struct
+{
+	struct usb_functionfs_descs_head_v2 capcalera;
+	__le32 num_fs;
+	struct
+	{
+		struct usb_interface_descriptor interficie;
+		struct usb_endpoint_descriptor_no_audio display;
+		struct usb_endpoint_descriptor_no_audio teclat;
+	} __attribute__((packed)) fs;
+} __attribute__((packed)) descriptors =
+{
+	.capcalera =
+	{
+		.magic = LE32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.flags = LE32(FUNCTIONFS_HAS_FS_DESC),
+		.length = LE32(sizeof(descriptors)),
+	},
+	.num_fs = LE32(3),
+	.fs =
+	{
+		.interficie =
+		{
+			.bLength = sizeof(descriptors.fs.interficie),
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bNumEndpoints = 2,
+			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+			.iInterface = 1,
+		},
+		.display =
+		{
+			.bLength = sizeof(descriptors.fs.display),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 1 | USB_DIR_OUT,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = LE16(MIDA_PAQUET),
+		},
+		.teclat =
+		{
+			.bLength = sizeof(descriptors.fs.teclat),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 2 | USB_DIR_IN,
+			.bmAttributes = USB_ENDPOINT_XFER_INT,
+			.wMaxPacketSize = LE16(8),
+			.bInterval = 10,
+		},
+	},
+};
+
+#define NOM_INTERFICIE	"Botodispusb (emulador)"
+
+static const struct
+{
+	struct usb_functionfs_strings_head capcalera;
+	struct
+	{
+		__le16 codi;
+		const char nom[sizeof(NOM_INTERFICIE)];
+	} __attribute__((packed)) idioma0;
+} __attribute__((packed)) cadenes =
+{
+	.capcalera =
+	{
+		.magic = LE32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = LE32(sizeof(cadenes)),
+		.str_count = LE32(1),
+		.lang_count = LE32(1),
+	},
+	.idioma0 = { LE16(0x0409), NOM_INTERFICIE },
+};
+
+
+
+/**
+ *	diferencia_us: diferencia en microsegons entre dos instants
+ */
+static unsigned long diferencia_us(const struct timespec *inici, const struct timespec *fi)
+{
+	return (fi->tv_sec - inici->tv_sec) * 1000000L + (fi->tv_nsec - inici->tv_nsec) / 1000;
+}
+
+
+/**
+ *	mostrar_dada: escriu un byte de dades a la memoria que indica l'ultima comanda d'adreça (amb 'mutex' agafat)
+ *		Si es l'eco de la xifra pendent, n'apunta la latencia i desperta el fil del teclat.
+ */
+static void mostrar_dada(unsigned char c)
+{
+	struct timespec ara;
+
+	if (emu.a_cgram)
+	{
+		emu.cgram[emu.adreca] = c;
+		emu.adreca = (emu.adreca + 1) % MIDA_CGRAM;
+		return;
+	}
+	emu.ddram[emu.adreca] = c;
+	emu.adreca = (emu.adreca + 1) % MIDA_DDRAM;
+
+	if (emu.xifra_pendent && (c == emu.xifra_pendent))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ara);
+		if (emu.num_latencies < MAX_LATENCIES)
+			emu.latencies[emu.num_latencies++] = diferencia_us(&emu.t_xifra, &ara);
+		emu.ecos++;
+		emu.xifra_pendent = 0;
+		pthread_cond_signal(&emu.cond_eco);
+	}
+}
+
+
+/**
+ *	executar_comanda: executa una comanda HD44780 (amb 'mutex' agafat)
+ *		Nomes cal emular les que canvien la memoria o l'adreça; la resta (encesa, mode d'entrada ...) s'ignoren.
+ */
+static void executar_comanda(unsigned char c)
+{
+	if (c & 0x80)
+	{	/* adreça de la DDRAM */
+		emu.adreca = c & 0x7f;
+		emu.a_cgram = 0;
+	}
+	else if (c & 0x40)
+	{	/* adreça de la CGRAM */
+		emu.adreca = c & 0x3f;
+		emu.a_cgram = 1;
+	}
+	else if (c == 0x01)
+	{	/* esborrat: tot espais i cursor a l'inici */
+		memset(emu.ddram, ' ', sizeof(emu.ddram));
+		emu.adreca = 0;
+		emu.a_cgram = 0;
+		emu.netejades++;
+	}
+}
+
+
+/**
+ *	fil_display: rep els paquets del bulk_out_endpoint i els aplica al display
+ */
+static void *fil_display(void *arg)
+{
+	unsigned char paquet[MIDA_PAQUET];
+	ssize_t n;
+	int i;
+
+	for (;;)
+	{
+		n = read(ep_display, paquet, sizeof(paquet));
+		if (n <= 0)
+		{	/* endpoint encara no habilitat o desconnectat: es torna a provar */
+			usleep(10000);
+			continue;
+		}
+		pthread_mutex_lock(&emu.mutex);
+		emu.paquets++;
+		emu.bytes += n;
+		for (i = 1; i < n; i++)
+		{
+			if (paquet[0] == TIPUS_COMANDA)
+			{
+				emu.comandes++;
+				executar_comanda(paquet[i]);
+			}
+			else
+			{
+				emu.dades++;
+				mostrar_dada(paquet[i]);
+			}
+		}
+		pthread_mutex_unlock(&emu.mutex);
+	}
+	return NULL;
+}
+
+
+/**
+ *	premer: envia una tecla pel interrupt_in_endpoint (espera que el host la reculli)
+ */
+static int premer(unsigned char tecla)
+{
+	while (write(ep_teclat, &tecla, 1) != 1)
+	{
+		if ((errno != EINTR) && (errno != EAGAIN) && (errno != ESHUTDOWN)) return -1;
+		usleep(10000);
+	}
+	pthread_mutex_lock(&emu.mutex);
+	emu.tecles++;
+	pthread_mutex_unlock(&emu.mutex);
+	return 0;
+}
+
+
+/**
+ *	fil_teclat: injecta les tandes de tecles que es demanen pel socket de control
+ *		Cada tecla es una xifra seguida d'una 'F'; la 'F' no es prem fins veure l'eco de la xifra
+ *		(si no, el driver podria enviar nomes l'estat final, sense la xifra).
+ */
+static void *fil_teclat(void *arg)
+{
+	struct timespec seguent, limit;
+	unsigned int i, per_segon, nombre;
+	unsigned char xifra;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&emu.mutex);
+		while (emu.tecles_demanades == 0)
+			pthread_cond_wait(&emu.cond_tecles, &emu.mutex);
+		per_segon = emu.tecles_per_segon;
+		nombre = emu.tecles_demanades;
+		pthread_mutex_unlock(&emu.mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &seguent);
+		for (i = 0; i < nombre; i++)
+		{
+			xifra = '0' + i % 10;
+			pthread_mutex_lock(&emu.mutex);
+			emu.xifra_pendent = xifra;
+			clock_gettime(CLOCK_MONOTONIC, &emu.t_xifra);
+			pthread_mutex_unlock(&emu.mutex);
+			if (premer(xifra)) break;
+
+			/* espera l'eco (el display el pot rebre abans que acabi 'premer') */
+			clock_gettime(CLOCK_REALTIME, &limit);
+			limit.tv_sec += ESPERA_ECO_MS / 1000;
+			pthread_mutex_lock(&emu.mutex);
+			while (emu.xifra_pendent &&
+			       (pthread_cond_timedwait(&emu.cond_eco, &emu.mutex, &limit) != ETIMEDOUT));
+			if (emu.xifra_pendent)
+			{
+				emu.ecos_perduts++;
+				emu.xifra_pendent = 0;
+			}
+			pthread_mutex_unlock(&emu.mutex);
+			if (premer('F')) break;
+
+			/* ritme demanat (0: tan rapid com es pugui) */
+			if (per_segon)
+			{
+				seguent.tv_nsec += 1000000000L / per_segon;
+				while (seguent.tv_nsec >= 1000000000L)
+				{
+					seguent.tv_nsec -= 1000000000L;
+					seguent.tv_sec++;
+				}
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &seguent, NULL);
+			}
+		}
+
+		pthread_mutex_lock(&emu.mutex);
+		emu.tecles_demanades = 0;
+		pthread_mutex_unlock(&emu.mutex);
+	}
+	return NULL;
+}
+
+
+/**
+ *	comparar: ordre de les latencies per a 'qsort'
+ */
+static int comparar(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/**
+ *	escriure_estat: deixa a 'buf' els comptadors en format clau=valor (amb 'mutex' agafat)
+ */
+static int escriure_estat(char *buf, size_t mida)
+{
+	unsigned long p50 = 0, p99 = 0, max = 0;
+
+	if (emu.num_latencies)
+	{
+		qsort(emu.latencies, emu.num_latencies, sizeof(unsigned long), comparar);
+		p50 = emu.latencies[emu.num_latencies / 2];
+		p99 = emu.latencies[emu.num_latencies * 99 / 100];
+		max = emu.latencies[emu.num_latencies - 1];
+	}
+	return snprintf(buf, mida,
+		"paquets=%lu bytes=%lu comandes=%lu dades=%lu netejades=%lu tecles=%lu ecos=%lu ecos_perduts=%lu "
+		"latencia_p50_us=%lu latencia_p99_us=%lu latencia_max_us=%lu injectant=%u\n",
+		emu.paquets, emu.bytes, emu.comandes, emu.dades, emu.netejades, emu.tecles, emu.ecos, emu.ecos_perduts,
+		p50, p99, max, emu.tecles_demanades);
+}
+
+
+/**
+ *	escriure_pantalla: deixa a 'buf' el contingut visible del display, una fila per linia (amb 'mutex' agafat)
+ */
+static int escriure_pantalla(char *buf, size_t mida)
+{
+	int f, c, adreca, n = 0;
+
+	for (f = 0; (f < emu.files) && ((size_t) (n + emu.columnes + 1) < mida); f++)
+	{
+		for (c = 0; c < emu.columnes; c++)
+		{
+			adreca = ((f & 1) ? 0x40 : 0) + ((f & 2) ? emu.columnes : 0) + c;	// com 'bdu_adreca'
+			buf[n++] = (emu.ddram[adreca] >= ' ') ? emu.ddram[adreca] : '?';
+		}
+		buf[n++] = '\n';
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+
+/**
+ *	fil_control: atén les peticions del socket de control
+ */
+static void *fil_control(void *arg)
+{
+	int s = *(int *) arg;
+	char peticio[MIDA_MISSATGE], resposta[MIDA_MISSATGE];
+	struct sockaddr_un origen;
+	socklen_t mida_origen;
+	unsigned int per_segon, nombre;
+	ssize_t n;
+	int r;
+
+	for (;;)
+	{
+		mida_origen = sizeof(origen);
+		n = recvfrom(s, peticio, sizeof(peticio) - 1, 0, (struct sockaddr *) &origen, &mida_origen);
+		if (n < 0) continue;
+		peticio[n] = '\0';
+
+		pthread_mutex_lock(&emu.mutex);
+		if (sscanf(peticio, "tecles %u %u", &per_segon, &nombre) == 2)
+		{
+			if (emu.tecles_demanades)
+				r = snprintf(resposta, sizeof(resposta), "error: ja s'estan injectant tecles\n");
+			else
+			{
+				emu.tecles_per_segon = per_segon;
+				emu.tecles_demanades = nombre;
+				pthread_cond_signal(&emu.cond_tecles);
+				r = snprintf(resposta, sizeof(resposta), "d'acord\n");
+			}
+		}
+		else if (strncmp(peticio, "estat", 5) == 0)
+			r = escriure_estat(resposta, sizeof(resposta));
+		else if (strncmp(peticio, "zero", 4) == 0)
+		{
+			emu.paquets = emu.bytes = emu.comandes = emu.dades = emu.netejades = 0;
+			emu.tecles = emu.ecos = emu.ecos_perduts = emu.num_latencies = 0;
+			r = snprintf(resposta, sizeof(resposta), "d'acord\n");
+		}
+		else if (strncmp(peticio, "pantalla", 8) == 0)
+			r = escriure_pantalla(resposta, sizeof(resposta));
+		else
+			r = snprintf(resposta, sizeof(resposta), "error: peticio desconeguda\n");
+		pthread_mutex_unlock(&emu.mutex);
+
+		if (mida_origen > sizeof(sa_family_t))	// nomes si l'origen te adreça a on respondre
+			sendto(s, resposta, r, 0, (struct sockaddr *) &origen, mida_origen);
+	}
+	return NULL;
+}
+
+
+/**
+ *	obrir_endpoint: obre el fitxer d'un endpoint de FunctionFS
+ */
+static int obrir_endpoint(const char *dir, const char *nom, int mode)
+{
+	char cami[256];
+	int fd;
+
+	snprintf(cami, sizeof(cami), "%s/%s", dir, nom);
+	fd = open(cami, mode);
+	if (fd < 0) perror(cami);
+	return fd;
+}
+
+
+/**
+ *	main: prepara FunctionFS i el socket de control i atén els esdeveniments de l'ep0
+ */
+int main(int argc, char *argv[])
+{
+	const char *dir_ffs = NULL, *cami_socket = SOCKET_DEF;
+	struct usb_functionfs_event esdeveniment;
+	struct sockaddr_un adreca;
+	pthread_t fil;
+	int s, opcio;
+
+	while ((opcio = getopt(argc, argv, "s:g:")) != -1)
+	{
+		switch (opcio)
+		{
+			case 's': cami_socket = optarg; break;
+			case 'g': sscanf(optarg, "%dx%d", &emu.files, &emu.columnes); break;
+			default:
+				fprintf(stderr, "us: %s [-s socket] [-g FILESxCOLUMNES] directori_functionfs\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc)
+	{
+		fprintf(stderr, "us: %s [-s socket] [-g FILESxCOLUMNES] directori_functionfs\n", argv[0]);
+		return 1;
+	}
+	dir_ffs = argv[optind];
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(emu.ddram, ' ', sizeof(emu.ddram));
+	emu.latencies = malloc(MAX_LATENCIES * sizeof(unsigned long));
+	if (!emu.latencies) return 1;
+
+	/* descriptors i cadenes: a partir d'aqui apareixen els fitxers dels endpoints */
+	ep0 = obrir_endpoint(dir_ffs, "ep0", O_RDWR);
+	if (ep0 < 0) return 1;
+	if ((write(ep0, &descriptors, sizeof(descriptors)) < 0) || (write(ep0, &cadenes, sizeof(cadenes)) < 0))
+	{
+		perror("ep0");
+		return 1;
+	}
+	ep_display = obrir_endpoint(dir_ffs, "ep1", O_RDONLY);
+	ep_teclat = obrir_endpoint(dir_ffs, "ep2", O_WRONLY);
+	if ((ep_display < 0) || (ep_teclat < 0)) return 1;
+
+	/* socket de control */
+	s = socket(AF_UNIX, SOCK_DGRAM, 0);
+	memset(&adreca, 0, sizeof(adreca));
+	adreca.sun_family = AF_UNIX;
+	strncpy(adreca.sun_path, cami_socket, sizeof(adreca.sun_path) - 1);
+	unlink(cami_socket);
+	if ((s < 0) || bind(s, (struct sockaddr *) &adreca, sizeof(adreca)))
+	{
+		perror(cami_socket);
+		return 1;
+	}
+
+	pthread_create(&fil, NULL, fil_display, NULL);
+	pthread_create(&fil, NULL, fil_teclat, NULL);
+	pthread_create(&fil, NULL, fil_control, &s);
+
+	/* esdeveniments de l'ep0: nomes s'informa dels canvis d'estat */
+	for (;;)
+	{
+		if (read(ep0, &esdeveniment, sizeof(esdeveniment)) != sizeof(esdeveniment))
+		{
+			if (errno == EINTR) continue;
+			perror("ep0");
+			return 1;
+		}
+		switch (esdeveniment.type)
+		{
+			case FUNCTIONFS_ENABLE:		fprintf(stderr, "bdu_emulador: connectat\n");		break;
+			case FUNCTIONFS_DISABLE:	fprintf(stderr, "bdu_emulador: desconnectat\n");	break;
+			case FUNCTIONFS_SUSPEND:	fprintf(stderr, "bdu_emulador: suspes\n");		break;
+			case FUNCTIONFS_RESUME:		fprintf(stderr, "bdu_emulador: represa\n");		break;
+			case FUNCTIONFS_SETUP:
+				/* cap peticio de control propia: es rebutja (STALL, operant en la direccio contraria) */
+				if (esdeveniment.u.setup.bRequestType & USB_DIR_IN)
+					(void) read(ep0, NULL, 0);
+				else
+					(void) write(ep0, NULL, 0);
+				break;
+			default:
+				break;
+		}
+	}
+	return 0;
+}